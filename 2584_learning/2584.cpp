@@ -11,21 +11,34 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <sys/wait.h>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistic.h"
+#include "ledger.h"
 
 int main(int argc, const char* argv[]) {
 	std::cout << "2584-Project: ";
 	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
 	std::cout << std::endl << std::endl;
 
-	size_t total = 1000, block = 0, limit = 0;
+	size_t total = 1000, block = 0, limit = 0, threads = 1, period = 0, keep = 0;
+	size_t evaluate = 0, eval_total = 1000, coordinate = 0;
 	std::string play_args, evil_args;
-	std::string load, save;
-	bool summary = false;
+	std::string load, save, eval_save = "stat.txt", sink, sink_format = "json";
+	bool summary = false, binary = false;
 	for (int i = 1; i < argc; i++) {
 		std::string para(argv[i]);
 		if (para.find("--total=") == 0) {
@@ -42,6 +55,26 @@ int main(int argc, const char* argv[]) {
 			load = para.substr(para.find("=") + 1);
 		} else if (para.find("--save=") == 0) {
 			save = para.substr(para.find("=") + 1);
+		} else if (para.find("--threads=") == 0) {
+			threads = std::max(std::stoull(para.substr(para.find("=") + 1)), 1ull);
+		} else if (para.find("--checkpoint=") == 0) {
+			period = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--keep=") == 0) {
+			keep = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--evaluate=") == 0) {
+			evaluate = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--eval-total=") == 0) {
+			eval_total = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--eval-save=") == 0) {
+			eval_save = para.substr(para.find("=") + 1);
+		} else if (para.find("--coordinate=") == 0) {
+			coordinate = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--telemetry=") == 0) {
+			sink = para.substr(para.find("=") + 1);
+		} else if (para.find("--telemetry-format=") == 0) {
+			sink_format = para.substr(para.find("=") + 1);
+		} else if (para.find("--binary") == 0) {
+			binary = true;
 		} else if (para.find("--summary") == 0) {
 			summary = true;
 		}
@@ -50,41 +83,154 @@ int main(int argc, const char* argv[]) {
 	statistic stat(total, block, limit);
 
 	if (load.size()) {
-		std::ifstream in(load, std::ios::in);
-		in >> stat;
+		std::ifstream in(load, std::ios::in | std::ios::binary);
+		if (!stat.read(in)) in >> stat; // the binary form or the text form
 		in.close();
 		summary |= stat.is_finished();
 	}
 
 	weight_agent play(play_args);
-	rndenv evil(evil_args);
-
-	while (!stat.is_finished()) {
-		play.open_episode("~:" + evil.name());
-		evil.open_episode(play.name() + ":~");
-
-		stat.open_episode(play.name() + ":" + evil.name());
-		episode& game = stat.back();
-		while (true) {
-			agent& who = game.take_turns(play, evil);
-			action move = who.take_action(game.state());
-			if (game.apply_action(move) != true) break;
-			if (who.check_for_win(game.state())) break;
+
+	// each block is also reported to the telemetry sink (if any), together with the memory usage of the process
+	// and the occupancy of the tables, which is estimated from every 64th entry to keep the report cheap
+	std::unique_ptr<telemetry> monitor(sink.size() ? new telemetry(sink, sink_format) : nullptr);
+	if (monitor) stat.report(monitor.get(), [&](telemetry::record& rec) {
+		rec.emplace_back("rss", telemetry::rss());
+		rec.emplace_back("occupancy", play.occupancy(64));
+	});
+
+	// the environment seed of each worker, worker i uses seed + i
+	unsigned seed = 1;
+	std::stringstream ss(evil_args);
+	for (std::string pair; ss >> pair; ) {
+		if (pair.find("seed=") == 0) seed = std::stoul(pair.substr(pair.find("=") + 1));
+	}
+
+	// checkpoints are named after the weight file to save and the number of games played, e.g., weights.bin.100000,
+	// they are written by forked children (see weight_agent::snapshot), and only the latest 'keep' are kept (all if 0)
+	std::string prefix = "weights.bin", shm;
+	std::stringstream sp(play_args);
+	for (std::string pair; sp >> pair; ) {
+		if (pair.find("save=") == 0) prefix = pair.substr(pair.find("=") + 1);
+		if (pair.find("shm=") == 0) shm = pair.substr(pair.find("=") + 1);
+	}
+	// a checkpoint counts toward 'keep' only once its writer has exited successfully, and the older ones are removed then;
+	// a checkpoint whose writer failed is reported and dropped, so that no good checkpoint is removed for it
+	std::deque<std::pair<std::string, pid_t>> checkpoints; // the path of each checkpoint and the pid of its writer (0 once written)
+	auto reap = [&](bool block) {
+		int status;
+		for (pid_t pid; (pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0; ) {
+			auto ck = std::find_if(checkpoints.begin(), checkpoints.end(), [=](const std::pair<std::string, pid_t>& c) { return c.second == pid; });
+			if (ck == checkpoints.end()) continue;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+				ck->second = 0;
+			} else {
+				std::cerr << "cannot write checkpoint " << ck->first << std::endl;
+				checkpoints.erase(ck);
+			}
+		}
+		size_t written = std::count_if(checkpoints.begin(), checkpoints.end(), [](const std::pair<std::string, pid_t>& c) { return c.second == 0; });
+		for (auto ck = checkpoints.begin(); keep && written > keep && ck != checkpoints.end(); ) {
+			if (ck->second != 0) {
+				ck++;
+				continue;
+			}
+			std::remove(ck->first.c_str());
+			ck = checkpoints.erase(ck);
+			written--;
 		}
-		agent& win = game.last_turns(play, evil);
-		stat.close_episode(win.name());
+	};
+	auto checkpoint = [&](size_t played) {
+		reap(false); // reap the finished checkpoints
+		std::string path = prefix + "." + std::to_string(played);
+		pid_t pid = play.snapshot(path);
+		if (pid < 0) {
+			std::cerr << "cannot fork for checkpoint " << path << std::endl;
+			return;
+		}
+		checkpoints.emplace_back(path, pid);
+	};
 
-		play.close_episode(win.name());
-		evil.close_episode(win.name());
+	// evaluations are played by forked children on a copy-on-write snapshot of the weights with alpha=0,
+	// each of which saves its statistic to a file named after the number of games played, e.g., stat.txt.100000
+	auto evaluation = [&](size_t played) {
+		reap(false); // reap the finished evaluations
+		pid_t pid = fork();
+		if (pid < 0) std::cerr << "cannot fork for evaluation at " << played << std::endl;
+		if (pid != 0) return;
+		play.notify("alpha=0");
+		rndenv evil(evil_args);
+		statistic result(eval_total);
+		std::ofstream log("/dev/null");
+		std::cout.rdbuf(log.rdbuf()); // keep the block reports out of the training log
+		while (!result.is_finished()) result.push_episode(play_episode(play, evil));
+		std::ofstream out(eval_save + "." + std::to_string(played), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (binary) result.write(out);
+		else out << result;
+		out.close();
+		_exit(out ? 0 : 1);
+	};
+
+	// the processes training a network in shared memory (shm=) record their episodes in its ledger,
+	// while a coordinator (--coordinate=SEC) plays no games but reports the ledger every SEC seconds,
+	// writes the checkpoints and runs the evaluations, and removes the shared memory after --total games in all
+	if (coordinate && shm.empty()) {
+		std::cerr << "--coordinate needs the shared weights of the trainers (shm=)" << std::endl;
+		return -1;
+	}
+	std::unique_ptr<ledger> book(shm.size() ? new ledger(shm) : nullptr);
+	if ((period || evaluate) && !coordinate && play.shared()) {
+		std::cerr << "--checkpoint and --evaluate need frozen snapshots, which shared weights (map=shared or shm=) cannot give" << std::endl;
+		return -1;
+	}
+	if (coordinate) {
+		ledger::tally last = book->read();
+		while (last.games < total) {
+			std::this_thread::sleep_for(std::chrono::seconds(coordinate));
+			ledger::tally now = book->read();
+			ledger::show(last, now);
+			if (period && now.games / period > last.games / period) checkpoint(now.games / period * period);
+			if (evaluate && now.games / evaluate > last.games / evaluate) evaluation(now.games / evaluate * evaluate);
+			last = now;
+		}
+		reap(true);
+		book->unlink();
+		shm_unlink(shm.c_str());
+		return 0;
 	}
 
+	// workers share the player (and its weights) and the statistic
+	std::mutex lock;
+	std::atomic<size_t> issued(0);
+	size_t played = 0;
+	const size_t games = stat.remain();
+	auto worker = [&](size_t id) {
+		rndenv evil(evil_args + (id ? " seed=" + std::to_string(seed + id) : ""));
+		while (issued++ < games) {
+			episode game = play_episode(play, evil);
+			std::lock_guard<std::mutex> guard(lock);
+			if (book) book->record(game);
+			stat.push_episode(std::move(game));
+			played++;
+			if (period && played % period == 0) checkpoint(played);
+			if (evaluate && played % evaluate == 0) evaluation(played);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (size_t id = 1; id < threads; id++) pool.emplace_back(worker, id);
+	worker(0);
+	for (std::thread& th : pool) th.join();
+	reap(true); // wait for the pending checkpoints and evaluations
+
 	if (summary) {
 		stat.summary();
 	}
 
 	if (save.size()) {
-		std::ofstream out(save, std::ios::out | std::ios::trunc);
-		out << stat;
+		std::ofstream out(save, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (binary) stat.write(out);
+		else out << stat;
 		out.close();
 	}
 
@@ -17,9 +17,19 @@
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "network.h"
+#include "transposition.h"
 #include <fstream>
+#include <cstdio>
+#include <unistd.h>
 #include <utility>
 #include <vector>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
 
 class agent {
 public:
@@ -54,6 +64,43 @@ protected:
 	std::map<key, value> meta;
 };
 
+/**
+ * xoshiro256++ generator, a fast alternative to std::default_random_engine
+ * the state is seeded by splitmix64 from a 64-bit seed
+ */
+class xoshiro {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+
+	xoshiro(uint64_t s = 1) { seed(s); }
+	void seed(uint64_t s) {
+		for (uint64_t& x : state) {
+			uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			x = z ^ (z >> 31);
+		}
+	}
+
+	result_type operator()() {
+		uint64_t result = rotl(state[0] + state[3], 23) + state[0];
+		uint64_t t = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = rotl(state[3], 45);
+		return result;
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+	uint64_t state[4];
+};
+
 /**
  * base agent for agents with randomness
  */
@@ -69,198 +116,538 @@ protected:
 	std::default_random_engine engine;
 };
 
+/**
+ * a step of the player: the reward of the chosen move and the feature indexes of its afterstate,
+ * which stand for the afterstate in the TD update
+ */
 struct step{
 	int reward;
-	board after;
+	std::array<network::index, network::limit> idx;
+};
+
+/**
+ * the steps of the episode being played by a thread
+ *
+ * steps are kept allocated across episodes and only the used ones count,
+ * so once the longest episode has been seen, no more allocation happens
+ */
+class trajectory {
+public:
+	trajectory() : used(0) {}
+
+	void clear() { used = 0; }
+	bool empty() const { return used == 0; }
+	size_t size() const { return used; }
+	step& operator [](size_t i) { return steps[i]; }
+	const step& operator [](size_t i) const { return steps[i]; }
+
+	/**
+	 * claim the next step, which holds stale content
+	 */
+	step& next() {
+		if (used == steps.size()) steps.emplace_back();
+		return steps[used++];
+	}
+
+private:
+	std::vector<step> steps;
+	size_t used;
 };
 
-std::vector<step> trajectory;
 /**
  * base agent for agents with weight tables and a learning rate
  */
 class weight_agent : public agent {
 public:
-	weight_agent(const std::string& args = "") : agent("name=TD-Learning role=player " + args), alpha(0) {
-		if (meta.find("init") != meta.end())
-			init_weights(meta["init"]);
-		if (meta.find("load") != meta.end())
-			load_weights(meta["load"]);
+	weight_agent(const std::string& args = "") : agent("name=TD-Learning role=player " + args),
+		net(meta.find("iso") != meta.end() ? network::isomorphic(isomorphic_patterns()) : patterns(), layout()), alpha(0), depth(1), budget(0), id(serial()) {
 		if (meta.find("alpha") != meta.end())
 			alpha = float(meta["alpha"]);
+		if (meta.find("depth") != meta.end())
+			depth = std::max(unsigned(meta["depth"]), 1u);
+		if (meta.find("budget") != meta.end())
+			budget = unsigned(meta["budget"]);
+		if (depth > 2 || meta.find("tt") != meta.end())
+			cache = transposition(meta.find("tt") != meta.end() ? unsigned(meta["tt"]) : 20);
+		net.allocate_by(policy());
+		if (meta.find("base") != meta.end())
+			load_base(meta["base"]);
+		bool attached = meta.find("shm") != meta.end() && net.attach(meta["shm"]);
+		if (meta.find("init") != meta.end() && !attached)
+			init_weights(meta["init"]);
+		if (meta.find("load") != meta.end() && !attached)
+			load_weights(meta["load"]);
+		if (meta.find("shm") != meta.end() && !attached && net.tables())
+			net.share(meta["shm"]);
+		if (meta.find("shm") != meta.end() && !attached && !net.tables() && !net.attach(meta["shm"], true)) {
+			std::cerr << "no shared weights to attach: " << meta["shm"].value << std::endl;
+			std::exit(-1);
+		}
+		if (meta.find("quantize") != meta.end())
+			net.quantize();
+		if (net.quantized() && alpha != 0) {
+			std::cerr << "quantized weights cannot be trained, use alpha=0" << std::endl;
+			std::exit(-1);
+		}
 	}
 	virtual ~weight_agent() {
+		if (meta.find("occupancy") != meta.end())
+			show_occupancy();
 		if (meta.find("save") != meta.end())
 			save_weights(meta["save"]);
 	}
 
-	int extract_feature(const board& after, int a, int b, int c, int d) const{
-		return after(a) * 25 * 25 * 25 + after(b) * 25 * 25 + after(c) * 25 + after(d);
-	}
-	int extract_feature_5(const board& after, int a, int b, int c, int d, int e) const{
-		return after(a) * 25 * 25 * 25 * 25 + after(b) * 25 * 25 * 25 + after(c) * 25 * 25 + after(d) * 25 + after(e);
+	virtual void notify(const std::string& msg) {
+		agent::notify(msg);
+		if (msg.find("alpha=") == 0)
+			alpha = float(meta["alpha"]);
 	}
-	int extract_feature_6(const board& after, int a, int b, int c, int d, int e, int f) const{
-		return after(a) * 25 * 25 * 25 * 25 * 25 + after(b) * 25 * 25 * 25 * 25 + after(c) * 25 * 25 * 25 + after(d) * 25 * 25 + after(e) * 25 + after(f);
+
+	/**
+	 * save the weights to path from a forked child, whose copy-on-write memory freezes the tables at the time of the call,
+	 * so that the caller can continue training at once; returns the pid of the child, or -1 if fork failed
+	 * note that the tables are not frozen if they are shared (see shared()), since the child then sees the updates
+	 */
+	pid_t snapshot(const std::string& path) const {
+		pid_t pid = fork();
+		if (pid != 0) return pid;
+		std::string temp = path + ".tmp";
+		std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (meta.find("compress") != meta.end()) net.deflate(out, origin.get());
+		else out << net;
+		out.close();
+		bool written = out && std::rename(temp.c_str(), path.c_str()) == 0;
+		if (!written) std::remove(temp.c_str());
+		_exit(written ? 0 : 1);
 	}
 
 	float estimate_value(const board& after) const {
-		float value = 0;
-		value += net[0][extract_feature(after, 0, 1, 2, 3)];
-		value += net[1][extract_feature(after, 4, 5, 6, 7)];
-		value += net[1][extract_feature(after, 8, 9, 10, 11)];
-		value += net[0][extract_feature(after, 12, 13, 14, 15)];
-		value += net[2][extract_feature(after, 0, 4, 8, 12)];
-		value += net[3][extract_feature(after, 1, 5, 9, 13)];
-		value += net[3][extract_feature(after, 2, 6, 10, 14)];
-		value += net[2][extract_feature(after, 3, 7, 11, 15)];
-		value += net[4][extract_feature_5(after, 8, 4, 0, 1, 2)];
-		value += net[4][extract_feature_5(after, 1, 2, 3, 7, 11)];
-		value += net[4][extract_feature_5(after, 7, 11, 15, 14, 13)];
-		value += net[4][extract_feature_5(after, 14, 13, 12, 8, 4)];
-		value += net[4][extract_feature_5(after, 0, 1, 2, 6, 10)];
-		value += net[4][extract_feature_5(after, 9, 5, 1, 2, 3)];
-		value += net[4][extract_feature_5(after, 5, 9, 13, 14, 15)];
-		value += net[4][extract_feature_5(after, 12, 13, 14, 10, 6)];
-		value += net[5][extract_feature_5(after, 1, 4, 5, 6, 9)];
-		value += net[5][extract_feature_5(after, 2, 5, 6, 7, 10)];
-		value += net[5][extract_feature_5(after, 5, 8, 9, 10, 13)];
-		value += net[5][extract_feature_5(after, 6, 9, 10, 11, 14)];
-		value += net[6][extract_feature_6(after, 0, 1, 2, 3, 4, 5)];
-		value += net[6][extract_feature_6(after, 0, 1, 2, 3, 6, 7)];
-		value += net[6][extract_feature_6(after, 8, 9, 12, 13, 14, 15)];
-		value += net[6][extract_feature_6(after, 10, 11, 12, 13, 14, 15)];
-		value += net[6][extract_feature_6(after, 0, 4, 8, 9, 12, 13)];
-		value += net[6][extract_feature_6(after, 0, 1, 4, 5, 8, 12)];
-		value += net[6][extract_feature_6(after, 3, 7, 10, 11, 14, 15)];
-		value += net[6][extract_feature_6(after, 2, 3, 6, 7, 11, 15)];
-		// value += net[3][extract_feature_6(after, 0, 1, 2, 4, 5, 8)];
-		// value += net[3][extract_feature_6(after, 1, 2, 3, 6, 7, 11)];
-		// value += net[3][extract_feature_6(after, 4, 8, 9, 12, 13, 14)];
-		// value += net[3][extract_feature_6(after, 7, 10, 11, 13, 14, 15)];
-		// value += net[3][extract_feature_6(after, 0, 1, 2, 5, 6, 10)];
-		// value += net[3][extract_feature_6(after, 1, 2, 3, 5, 6, 9)];
-		// value += net[3][extract_feature_6(after, 6, 9, 10, 12, 13, 14)];
-		// value += net[3][extract_feature_6(after, 5, 9, 10, 13, 14, 15)];
+		return net.estimate(after);
+	}
 
-		return value;
+	/**
+	 * the values of n afterstates, evaluated as a batch (see network::estimate)
+	 */
+	void estimate_values(const board* after, size_t n, float* value) const {
+		net.estimate(after, n, value);
+	}
+
+	/**
+	 * whether the updates are written to tables shared with the file or other processes (map=shared or shm=),
+	 * whose pages are not copied on write by forked children
+	 */
+	bool shared() const {
+		return net.writeback();
+	}
+
+	/**
+	 * whether the weights can be updated, i.e., they are neither quantized nor mapped read-only
+	 */
+	bool trainable() const {
+		return !net.quantized() && !net.readonly();
+	}
+
+	/**
+	 * the feature indexes of an afterstate, as kept in a step for the TD update
+	 */
+	void features(const board& after, network::index* idx) const {
+		net.indexes(after, idx);
 	}
 
 	void adjust_weight(const board& after, float target){
-		float current = estimate_value(after);
-		float err = target - current;
-		float adjust = alpha * err;
-		net[0][extract_feature(after, 0, 1, 2, 3)] += adjust;
-		net[1][extract_feature(after, 4, 5, 6, 7)] += adjust;
-		net[1][extract_feature(after, 8, 9, 10, 11)] += adjust;
-		net[0][extract_feature(after, 12, 13, 14, 15)] += adjust;
-		net[2][extract_feature(after, 0, 4, 8, 12)] += adjust;
-		net[3][extract_feature(after, 1, 5, 9, 13)] += adjust;
-		net[3][extract_feature(after, 2, 6, 10, 14)] += adjust;
-		net[2][extract_feature(after, 3, 7, 11, 15)] += adjust;
-		net[4][extract_feature_5(after, 8, 4, 0, 1, 2)] += adjust;
-		net[4][extract_feature_5(after, 1, 2, 3, 7, 11)] += adjust;
-		net[4][extract_feature_5(after, 7, 11, 15, 14, 13)] += adjust;
-		net[4][extract_feature_5(after, 14, 13, 12, 8, 4)] += adjust;
-		net[4][extract_feature_5(after, 0, 1, 2, 6, 10)] += adjust;
-		net[4][extract_feature_5(after, 9, 5, 1, 2, 3)] += adjust;
-		net[4][extract_feature_5(after, 5, 9, 13, 14, 15)] += adjust;
-		net[4][extract_feature_5(after, 12, 13, 14, 10, 6)] += adjust;
-		net[5][extract_feature_5(after, 1, 4, 5, 6, 9)] += adjust;
-		net[5][extract_feature_5(after, 2, 5, 6, 7, 10)] += adjust;
-		net[5][extract_feature_5(after, 5, 8, 9, 10, 13)] += adjust;
-		net[5][extract_feature_5(after, 6, 9, 10, 11, 14)] += adjust;
-		net[6][extract_feature_6(after, 0, 1, 2, 3, 4, 5)] += adjust;
-		net[6][extract_feature_6(after, 0, 1, 2, 3, 6, 7)] += adjust;
-		net[6][extract_feature_6(after, 8, 9, 12, 13, 14, 15)] += adjust;
-		net[6][extract_feature_6(after, 10, 11, 12, 13, 14, 15)] += adjust;
-		net[6][extract_feature_6(after, 0, 4, 8, 9, 12, 13)] += adjust;
-		net[6][extract_feature_6(after, 0, 1, 4, 5, 8, 12)] += adjust;
-		net[6][extract_feature_6(after, 3, 7, 10, 11, 14, 15)] += adjust;
-		net[6][extract_feature_6(after, 2, 3, 6, 7, 11, 15)] += adjust;
-		// net[3][extract_feature_6(after, 0, 1, 2, 4, 5, 8)] += adjust;
-		// net[3][extract_feature_6(after, 1, 2, 3, 6, 7, 11)] += adjust;
-		// net[3][extract_feature_6(after, 4, 8, 9, 12, 13, 14)] += adjust;
-		// net[3][extract_feature_6(after, 7, 10, 11, 13, 14, 15)] += adjust;
-		// net[3][extract_feature_6(after, 0, 1, 2, 5, 6, 10)] += adjust;
-		// net[3][extract_feature_6(after, 1, 2, 3, 5, 6, 9)] += adjust;
-		// net[3][extract_feature_6(after, 6, 9, 10, 12, 13, 14)] += adjust;
-		// net[3][extract_feature_6(after, 5, 9, 10, 13, 14, 15)] += adjust;
+		network::index idx[network::limit];
+		net.indexes(after, idx);
+		float err = target - net.estimate(idx);
+		net.update(idx, alpha * err);
+	}
+
+	static size_t serial() {
+		static std::atomic<size_t> count(0);
+		return ++count;
+	}
+
+	/**
+	 * the patterns of the network, the second value is the table shared by the pattern
+	 */
+	static std::vector<network::pattern> patterns() {
+		return {
+			{ { 0, 1, 2, 3 }, 0 },
+			{ { 4, 5, 6, 7 }, 1 },
+			{ { 8, 9, 10, 11 }, 1 },
+			{ { 12, 13, 14, 15 }, 0 },
+			{ { 0, 4, 8, 12 }, 2 },
+			{ { 1, 5, 9, 13 }, 3 },
+			{ { 2, 6, 10, 14 }, 3 },
+			{ { 3, 7, 11, 15 }, 2 },
+			{ { 8, 4, 0, 1, 2 }, 4 },
+			{ { 1, 2, 3, 7, 11 }, 4 },
+			{ { 7, 11, 15, 14, 13 }, 4 },
+			{ { 14, 13, 12, 8, 4 }, 4 },
+			{ { 0, 1, 2, 6, 10 }, 4 },
+			{ { 9, 5, 1, 2, 3 }, 4 },
+			{ { 5, 9, 13, 14, 15 }, 4 },
+			{ { 12, 13, 14, 10, 6 }, 4 },
+			{ { 1, 4, 5, 6, 9 }, 5 },
+			{ { 2, 5, 6, 7, 10 }, 5 },
+			{ { 5, 8, 9, 10, 13 }, 5 },
+			{ { 6, 9, 10, 11, 14 }, 5 },
+			{ { 0, 1, 2, 3, 4, 5 }, 6 },
+			{ { 0, 1, 2, 3, 6, 7 }, 6 },
+			{ { 8, 9, 12, 13, 14, 15 }, 6 },
+			{ { 10, 11, 12, 13, 14, 15 }, 6 },
+			{ { 0, 4, 8, 9, 12, 13 }, 6 },
+			{ { 0, 1, 4, 5, 8, 12 }, 6 },
+			{ { 3, 7, 10, 11, 14, 15 }, 6 },
+			{ { 2, 3, 6, 7, 11, 15 }, 6 },
+		};
+	}
+
+	/**
+	 * the base patterns of the network with the flag "iso", each of which is expanded into its 8 isomorphisms
+	 */
+	static std::vector<network::pattern> isomorphic_patterns() {
+		return {
+			{ { 0, 1, 2, 3 }, 0 },
+			{ { 4, 5, 6, 7 }, 1 },
+			{ { 8, 4, 0, 1, 2 }, 2 },
+			{ { 1, 4, 5, 6, 9 }, 3 },
+			{ { 0, 1, 2, 3, 4, 5 }, 4 },
+		};
+	}
+
+	/**
+	 * the table layout given by "bound" (tile bound), "index=shift" (bit-shift indexing),
+	 * and "hash" (log2 of the capacity beyond which a table is hashed)
+	 */
+	network::layout layout() {
+		network::layout lay;
+		if (meta.find("bound") != meta.end())
+			lay.bound = network::index(meta["bound"]);
+		if (meta.find("index") != meta.end())
+			lay.shift = (meta["index"].value == "shift");
+		if (meta.find("hash") != meta.end())
+			lay.hash = unsigned(meta["hash"]);
+		return lay;
+	}
+
+	/**
+	 * the allocation policy given by "hugepages" (transparent), "hugepages=2m" or "hugepages=1g" (explicit),
+	 * and "numa=interleave"
+	 */
+	network::policy policy() {
+		network::policy pol;
+		if (meta.find("hugepages") != meta.end()) {
+			std::string page = meta["hugepages"];
+			pol.huge = true;
+			pol.page = page == "2m" ? 21 : page == "1g" ? 30 : 0;
+		}
+		if (meta.find("numa") != meta.end())
+			pol.interleave = (meta["numa"].value == "interleave");
+		return pol;
 	}
 
+	/**
+	 * the fraction of nonzero entries in all tables, or an estimate from every stride-th entry of each table
+	 */
+	double occupancy(size_t stride = 1) const {
+		double used = 0, size = 0;
+		for (size_t t = 0; t < net.tables(); t++) {
+			used += net.occupancy(t, stride) * net.entries(t);
+			size += net.entries(t);
+		}
+		return size ? used / size : 0;
+	}
+
+	void show_occupancy() const {
+		for (size_t t = 0; t < net.tables(); t++) {
+			std::cout << "table " << t << "\t" << "size = " << net.entries(t) << ", ";
+			std::cout << "occupancy = " << (net.occupancy(t) * 100) << "%" << std::endl;
+		}
+	}
+
+	/**
+	 * values cached under the weights of earlier episodes are dropped when training (alpha is not 0),
+	 * since the TD updates at the end of each episode have changed those weights
+	 */
 	virtual void open_episode(const std::string& flag = "") {
-		trajectory.clear();
+		path().clear();
+		if (alpha != 0) cache.clear();
 	}
+	/**
+	 * backward TD(0) over the trajectory, the target of each afterstate is the reward plus the updated value of its successor
+	 *
+	 * values are read again rather than kept from the moves, since the update of a successor
+	 * usually changes entries shared with its predecessor
+	 */
 	virtual void close_episode(const std::string& flag = "") {
-		if(trajectory.empty()) return;
+		trajectory& steps = path();
+		if(steps.empty()) return;
 		if(alpha == 0) return;
-		adjust_weight(trajectory[trajectory.size()-1].after, 0);
-		for(int i = trajectory.size()-2;i>=0;i--){
-			adjust_weight(trajectory[i].after, 
-				trajectory[i+1].reward + estimate_value(trajectory[i+1].after));
+		float target = 0;
+		for(int i = steps.size()-1;i>=0;i--){
+			const network::index* idx = steps[i].idx.data();
+			net.update(idx, alpha * (target - net.estimate(idx)));
+			target = steps[i].reward + net.estimate(idx);
 		}
 	}
 
 protected:
 	virtual void init_weights(const std::string& info) {
-		net.emplace_back(25 * 25 * 25 * 25); 
-		net.emplace_back(25 * 25 * 25 * 25); 
-		net.emplace_back(25 * 25 * 25 * 25); 
-		net.emplace_back(25 * 25 * 25 * 25); 
-		net.emplace_back(25 * 25 * 25 * 25 * 25); 
-		net.emplace_back(25 * 25 * 25 * 25 * 25);
-		net.emplace_back(25 * 25 * 25 * 25 * 25 * 25);
-		// net.emplace_back(25 * 25 * 25 * 25 * 25 * 25);
-		// net.emplace_back(25 * 25 * 25 * 25); 
-		// net.emplace_back(25 * 25 * 25 * 25); 
-		// net.emplace_back(25 * 25 * 25 * 25); 
+		net.init();
 	}
+	/**
+	 * versioned weight files (version 1, or version 2 as written by save_weights) are mapped rather than read,
+	 * while compressed and unversioned files are always read; the mapping is specified by "map":
+	 * "private" (default) for copy-on-write, "shared" for writing updates back to the file, or "off" for reading;
+	 * the mapping is always read-only if alpha is 0, and files are read by default if an allocation policy is given
+	 */
 	virtual void load_weights(const std::string& path) {
+		bool placed = meta.find("hugepages") != meta.end() || meta.find("numa") != meta.end();
+		std::string mode = meta.find("map") != meta.end() ? std::string(meta["map"]) : placed ? "off" : "private";
+		if (mode != "off" && net.map(path, alpha != 0, mode == "shared")) return;
 		std::ifstream in(path, std::ios::in | std::ios::binary);
 		if (!in.is_open()) std::exit(-1);
-		uint32_t size;
-		in.read(reinterpret_cast<char*>(&size), sizeof(size));
-		net.resize(size);
-		for (weight& w : net) in >> w;
+		net.inflate(in, origin.get()); // also reads the uncompressed formats
 		in.close();
 	}
+	/**
+	 * load the base of delta weights (base=), which must be a full (not delta) weight file
+	 */
+	virtual void load_base(const std::string& path) {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		if (!in.is_open()) {
+			std::cerr << "cannot open base weights: " << path << std::endl;
+			std::exit(-1);
+		}
+		origin.reset(new network(net));
+		in >> *origin;
+		in.close();
+	}
+	/**
+	 * the weights are written to a temporary file which then replaces the target,
+	 * so that a file still being mapped (by this or other processes) is never truncated
+	 */
 	virtual void save_weights(const std::string& path) {
-		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		bool compress = meta.find("compress") != meta.end();
+		if (meta.find("load") != meta.end() && path == meta["load"].value && meta.find("shm") == meta.end() && !compress && net.sync()) return;
+		std::string temp = path + ".tmp";
+		std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
 		if (!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
-		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for (weight& w : net) out << w;
+		if (compress) net.deflate(out, origin.get());
+		else out << net;
 		out.close();
+		if (!out || std::rename(temp.c_str(), path.c_str()) != 0) std::exit(-1);
 	}
 
 	virtual action take_action(const board& before) {
-		int best_op = -1;
-		int best_reward = -1;
-		float best_value = -1000000;
-		board best_after;
+		if (depth > 1) return search(before);
+		board after[4] = { before, before, before, before };
+		int reward[4];
+		network::index idx[4][network::limit];
 		for(int op : {0, 1, 2, 3}){
-			board after = before;
-			int reward = after.slide(op);
-			if(reward == -1) continue;
+			reward[op] = after[op].slide(op);
+			if(reward[op] == -1) {
+				std::fill(idx[op], idx[op] + net.size(), 0);
+				continue;
+			}
+			net.indexes(after[op], idx[op]);
+			net.prefetch(idx[op]);
+		}
+		float value[4];
+		net.estimate(idx, value);
 
-			float value = estimate_value(after);
-			if(reward + value > best_reward + best_value){
+		int best_op = -1;
+		for(int op : {0, 1, 2, 3}){
+			if(reward[op] == -1) continue;
+			if(best_op == -1 || reward[op] + value[op] > reward[best_op] + value[best_op]){
 				best_op = op;
-				best_reward = reward;
-				best_value = value;
-				best_after = after;
 			}
 		}
 
 		if(best_op != -1){
-			trajectory.push_back({best_reward, best_after});
+			record(reward[best_op], idx[best_op]);
+		}
+
+		return action::slide(best_op);
+	}
+
+	/**
+	 * expectimax search over "depth" moves of the player, in which all placements of the environment
+	 * (every empty cell, with a 1-tile at 90% and a 2-tile at 10%) are expanded, and leaves are afterstates
+	 * evaluated by the network
+	 *
+	 * the search deepens iteratively from depth 1; if a time budget (in ms) is given,
+	 * the deepest search that completes within the budget decides the move
+	 */
+	action search(const board& before) {
+		typedef std::chrono::steady_clock clock;
+		limit time = { budget ? clock::now() + std::chrono::milliseconds(budget) : clock::time_point::max(), false };
+		int best_op = -1;
+		int best_reward = -1;
+		board best_after;
+		for (unsigned d = 1; d <= depth && !time.exceeded; d++) {
+			int op_d = -1, reward_d = -1;
+			float value_d = -std::numeric_limits<float>::max();
+			board after_d;
+			for (int op : { 0, 1, 2, 3 }) {
+				board after = before;
+				int reward = after.slide(op);
+				if (reward == -1) continue;
+				float value = expect(after, d - 1, time);
+				if (reward + value > reward_d + value_d) {
+					op_d = op;
+					reward_d = reward;
+					value_d = value;
+					after_d = after;
+				}
+			}
+			if (time.exceeded) break;
+			best_op = op_d;
+			best_reward = reward_d;
+			best_after = after_d;
+			if (best_op == -1) break;
+		}
+
+		if (best_op != -1) {
+			network::index idx[network::limit];
+			net.indexes(best_after, idx);
+			record(best_reward, idx);
 		}
 
 		return action::slide(best_op);
 	}
 
 protected:
-	std::vector<weight> net;
+	/**
+	 * the trajectory of the calling thread for this agent, so that several threads can play episodes
+	 * with one agent at the same time; trajectories are created on first use and owned by the agent
+	 */
+	trajectory& path() {
+		thread_local std::vector<std::pair<size_t, trajectory*>> mine; // (agent id, trajectory) of this thread
+		for (const std::pair<size_t, trajectory*>& c : mine) {
+			if (c.first == id) return *c.second;
+		}
+		std::lock_guard<std::mutex> guard(paths_lock);
+		paths.emplace_back();
+		mine.emplace_back(id, &paths.back());
+		return paths.back();
+	}
+
+	void record(int reward, const network::index* idx) {
+		step& s = path().next();
+		s.reward = reward;
+		std::copy(idx, idx + net.size(), s.idx.begin());
+	}
+
+	struct limit {
+		std::chrono::steady_clock::time_point deadline;
+		bool exceeded;
+	};
+
+	/**
+	 * the expected value of an afterstate followed by d more moves of the player,
+	 * which is cached in the transposition table unless the search runs out of time
+	 */
+	float expect(const board& after, unsigned d, limit& time) {
+		if (d == 0) return estimate_value(after);
+		float value;
+		if (cache.find(after, d, value)) return value;
+		if (time.exceeded || std::chrono::steady_clock::now() > time.deadline) {
+			time.exceeded = true;
+			return 0;
+		}
+		if (d == 1) {
+			value = expect_leaves(after);
+			cache.store(after, d, value);
+			return value;
+		}
+		float sum = 0;
+		unsigned empty = 0;
+		for (unsigned pos = 0; pos < 16; pos++) {
+			if (after(pos) != 0) continue;
+			board one = after, two = after;
+			one.place(pos, 1);
+			two.place(pos, 2);
+			sum += 0.9f * maximize(one, d, time) + 0.1f * maximize(two, d, time);
+			empty++;
+		}
+		value = empty ? sum / empty : estimate_value(after);
+		if (!time.exceeded) cache.store(after, d, value);
+		return value;
+	}
+
+	/**
+	 * the expected value of an afterstate followed by one more move of the player,
+	 * in which the afterstates of all placements and slides are evaluated as one batch
+	 */
+	float expect_leaves(const board& after) const {
+		board leaf[16 * 2 * 4];
+		int reward[16 * 2 * 4];
+		float value[16 * 2 * 4];
+		size_t n = 0;
+		for (unsigned pos = 0; pos < 16; pos++) {
+			if (after(pos) != 0) continue;
+			for (board::cell tile : { 1, 2 }) {
+				board state = after;
+				state.place(pos, tile);
+				for (int op : { 0, 1, 2, 3 }) {
+					leaf[n] = state;
+					reward[n] = leaf[n].slide(op);
+					n++;
+				}
+			}
+		}
+		if (n == 0) return estimate_value(after);
+		size_t legal = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (reward[i] != -1) leaf[legal++] = leaf[i];
+		}
+		estimate_values(leaf, legal, value);
+
+		float sum = 0;
+		for (size_t i = 0, v = 0; i < n; i += 8) {
+			float best[2] = { 0, 0 }; // the best values after a 1-tile and a 2-tile, 0 if the game is over
+			for (size_t t = 0; t < 2; t++) {
+				bool moved = false;
+				for (size_t j = i + t * 4; j < i + t * 4 + 4; j++) {
+					if (reward[j] == -1) continue;
+					float result = reward[j] + value[v++];
+					if (!moved || result > best[t]) best[t] = result;
+					moved = true;
+				}
+			}
+			sum += 0.9f * best[0] + 0.1f * best[1];
+		}
+		return sum / (n / 8);
+	}
+
+	/**
+	 * the best value of a state with d more moves of the player, or 0 if the game is over
+	 */
+	float maximize(const board& before, unsigned d, limit& time) {
+		float best = 0;
+		bool moved = false;
+		for (int op : { 0, 1, 2, 3 }) {
+			board after = before;
+			int reward = after.slide(op);
+			if (reward == -1) continue;
+			float value = reward + expect(after, d - 1, time);
+			if (!moved || value > best) best = value;
+			moved = true;
+		}
+		return best;
+	}
+
+protected:
+	network net;
+	std::unique_ptr<network> origin; // the base of delta weights, if any
 	float alpha;
+	unsigned depth; // the number of moves searched by the player, 1 for greedy
+	unsigned budget; // the time budget of a move in ms, 0 for unlimited
+	transposition cache; // the values of searched afterstates, with 2^tt entries (2^20 by default if depth > 2)
+	std::deque<trajectory> paths; // one trajectory per thread, see path()
+	std::mutex paths_lock;
+	size_t id; // the unique id of this agent, which keys the trajectories cached by threads
 };
 
 /**
@@ -272,9 +659,15 @@ protected:
 class rndenv : public random_agent {
 public:
 	rndenv(const std::string& args = "") : random_agent("name=random role=environment " + args),
-		space({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }), popup(0, 9) {}
+		space({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }), popup(0, 9), fast(false) {
+		if (meta.find("rng") != meta.end())
+			fast = (meta["rng"].value == "fast");
+		if (meta.find("seed") != meta.end())
+			quick.seed(uint64_t(meta["seed"]));
+	}
 
 	virtual action take_action(const board& after) {
+		if (fast) return place(after);
 		std::shuffle(space.begin(), space.end(), engine);
 		for (int pos : space) {
 			if (after(pos) != 0) continue;
@@ -284,9 +677,26 @@ public:
 		return action();
 	}
 
+	/**
+	 * place a tile with "rng=fast": one draw of xoshiro picks a uniformly random empty cell
+	 * from the mask of empty cells (high 32 bits) and the tile with the same 90/10 odds (low 32 bits)
+	 */
+	action place(const board& after) {
+		uint32_t empty = after.empty_mask();
+		if (empty == 0) return action();
+		uint64_t r = quick();
+		unsigned k = ((r >> 32) * __builtin_popcount(empty)) >> 32;
+		for (; k; k--) empty &= empty - 1;
+		unsigned pos = __builtin_ctz(empty);
+		board::cell tile = ((r & 0xffffffffull) * 10) >> 32 ? 1 : 2;
+		return action::place(pos, tile);
+	}
+
 private:
 	std::array<int, 16> space;
 	std::uniform_int_distribution<int> popup;
+	bool fast;
+	xoshiro quick;
 };
 
 /**
@@ -0,0 +1,172 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * bench.cpp: Microbenchmarks of the hot paths
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+
+/**
+ * the result of a benchmark: the operations done and the time they took
+ */
+struct measure {
+	std::string name;
+	uint64_t ops;
+	uint64_t ns;
+};
+
+/**
+ * repeat pass() until at least 'least' ms elapsed, where each pass returns the number of operations it did
+ */
+measure run(const std::string& name, unsigned least, const std::function<size_t()>& pass) {
+	typedef std::chrono::steady_clock clock;
+	pass(); // warm up the caches and the tables
+	uint64_t ops = 0;
+	auto start = clock::now();
+	auto limit = start + std::chrono::milliseconds(least);
+	auto now = start;
+	do {
+		ops += pass();
+		now = clock::now();
+	} while (now < limit);
+	return { name, ops, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()) };
+}
+
+int main(int argc, const char* argv[]) {
+	size_t games = 100;
+	unsigned least = 500;
+	bool json = false;
+	std::string play_args = "init", evil_args = "seed=1", only;
+	for (int i = 1; i < argc; i++) {
+		std::string para(argv[i]);
+		if (para.find("--games=") == 0) {
+			games = std::max(std::stoull(para.substr(para.find("=") + 1)), 1ull);
+		} else if (para.find("--time=") == 0) {
+			least = std::stoul(para.substr(para.find("=") + 1));
+		} else if (para.find("--play=") == 0) {
+			play_args = para.substr(para.find("=") + 1);
+		} else if (para.find("--evil=") == 0) {
+			evil_args = para.substr(para.find("=") + 1);
+		} else if (para.find("--only=") == 0) {
+			only = para.substr(para.find("=") + 1);
+		} else if (para.find("--json") == 0) {
+			json = true;
+		}
+	}
+
+	if (!json) {
+		std::cout << "2584-Bench: ";
+		std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
+		std::cout << std::endl << std::endl;
+	}
+
+	// the corpora are the states before and after the moves of the player in games played by the seeded environment
+	weight_agent play(play_args);
+	std::vector<board> before, after;
+	{
+		rndenv evil(evil_args);
+		for (size_t g = 0; g < games; g++) {
+			episode game;
+			play.open_episode();
+			while (true) {
+				agent& who = game.take_turns(play, evil);
+				(&who == &play ? before : after).push_back(game.state());
+				if (game.apply_action(who.take_action(game.state())) != true) break;
+			}
+			play.close_episode();
+		}
+	}
+
+	volatile float sink = 0; // keeps the results alive
+	std::vector<measure> result;
+	auto bench = [&](const std::string& name, const std::function<size_t()>& pass) {
+		if (only.size() && name.find(only) == std::string::npos) return;
+		result.push_back(run(name, least, pass));
+	};
+
+	const char* slides[] = { "slide_up", "slide_right", "slide_down", "slide_left" };
+	for (unsigned op = 0; op < 4; op++) {
+		bench(slides[op], [&]() {
+			board::reward sum = 0;
+			for (const board& b : before) sum += board(b).slide(op);
+			sink = sink + sum;
+			return before.size();
+		});
+	}
+	bench("extract_feature", [&]() {
+		network::index idx[network::limit];
+		network::index sum = 0;
+		for (const board& b : after) {
+			play.features(b, idx);
+			sum += idx[0];
+		}
+		sink = sink + sum;
+		return after.size();
+	});
+	bench("estimate_value", [&]() {
+		float sum = 0;
+		for (const board& b : after) sum += play.estimate_value(b);
+		sink = sink + sum;
+		return after.size();
+	});
+	if (play.trainable()) {
+		bench("adjust_weight", [&]() {
+			for (const board& b : after) play.adjust_weight(b, 0);
+			return after.size();
+		});
+	} else if (!json) {
+		std::cout << "adjust_weight is skipped since the weights cannot be updated (e.g., mapped read-only with alpha=0)" << std::endl << std::endl;
+	}
+	for (std::string rng : { "default", "fast" }) {
+		bench("rndenv_take_action" + (rng == "fast" ? "_fast" : std::string()), [&]() {
+			rndenv evil(evil_args + " rng=" + rng);
+			unsigned sum = 0;
+			for (const board& b : after) sum += evil.take_action(b).event();
+			sink = sink + sum;
+			return after.size();
+		});
+	}
+	bench("episode", [&]() {
+		rndenv evil(evil_args);
+		play_episode(play, evil);
+		return 1;
+	});
+
+	if (json) {
+		std::cout << "{\"corpus\": {\"games\": " << games << ", \"before\": " << before.size() << ", \"after\": " << after.size() << "}, ";
+		std::cout << "\"benchmarks\": [";
+		for (size_t i = 0; i < result.size(); i++) {
+			const measure& m = result[i];
+			std::cout << (i ? ", " : "") << "{\"name\": \"" << m.name << "\", \"ops\": " << m.ops << ", \"ns\": " << m.ns;
+			std::cout << std::fixed << std::setprecision(3);
+			std::cout << ", \"ns_per_op\": " << (double(m.ns) / m.ops) << ", \"ops_per_sec\": " << (m.ops * 1e9 / m.ns) << "}";
+			std::cout.unsetf(std::ios::floatfield);
+		}
+		std::cout << "]}" << std::endl;
+		return 0;
+	}
+
+	std::cout << "corpus: " << games << " games, " << before.size() << " states before and " << after.size() << " after the moves" << std::endl;
+	std::cout << std::endl;
+	std::cout << std::left << std::setw(24) << "benchmark" << std::right << std::setw(14) << "ns/op" << std::setw(16) << "ops/s" << std::endl;
+	std::cout << std::fixed << std::setprecision(1);
+	for (const measure& m : result) {
+		std::cout << std::left << std::setw(24) << m.name << std::right;
+		std::cout << std::setw(14) << (double(m.ns) / m.ops) << std::setw(16) << std::setprecision(0) << (m.ops * 1e9 / m.ns) << std::setprecision(1) << std::endl;
+	}
+	return 0;
+}
@@ -9,13 +9,15 @@
 
 #pragma once
 #include <array>
+#include <vector>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 
 /**
- * array-based board for 2048
+ * bitboard for 2584
  *
  * index (1-d form):
  *  (0)  (1)  (2)  (3)
@@ -23,6 +25,11 @@
  *  (8)  (9) (10) (11)
  * (12) (13) (14) (15)
  *
+ * each row is packed into the low 20 bits of a 32-bit word, 5 bits per tile,
+ * with the leftmost tile in the lowest bits; tiles are therefore limited to index 31
+ *
+ * all slides are table lookups on packed rows (left/right) or on packed columns (up/down),
+ * see board::lookup for the precomputed tables
  */
 std::array<int, 33> fibs = {1, 1};
 int fib(int i){
@@ -37,28 +44,93 @@ public:
 	typedef uint32_t cell;
 	typedef std::array<cell, 4> row;
 	typedef std::array<row, 4> grid;
+	typedef uint32_t line;
+	typedef std::array<line, 4> packed;
 	typedef uint64_t data;
 	typedef int reward;
 
 public:
-	board() : tile(), attr(0) {}
-	board(const grid& b, data v = 0) : tile(b), attr(v) {}
+	board() : raw(), attr(0) {}
+	board(const packed& b, data v = 0) : raw(b), attr(v) {}
+	board(const grid& b, data v = 0) : raw(), attr(v) {
+		for (int i = 0; i < 16; i++) set(i, b[i / 4][i % 4]);
+	}
 	board(const board& b) = default;
 	board& operator =(const board& b) = default;
 
-	operator grid&() { return tile; }
-	operator const grid&() const { return tile; }
-	row& operator [](unsigned i) { return tile[i]; }
-	const row& operator [](unsigned i) const { return tile[i]; }
-	cell& operator ()(unsigned i) { return tile[i / 4][i % 4]; }
-	const cell& operator ()(unsigned i) const { return tile[i / 4][i % 4]; }
+	operator grid() const {
+		grid g;
+		for (int i = 0; i < 16; i++) g[i / 4][i % 4] = operator()(i);
+		return g;
+	}
+	row operator [](unsigned i) const { return { cell(raw[i] & 0x1f), cell((raw[i] >> 5) & 0x1f), cell((raw[i] >> 10) & 0x1f), cell(raw[i] >> 15) }; }
+	cell operator ()(unsigned i) const { return (raw[i >> 2] >> ((i & 3) * 5)) & 0x1f; }
+	void set(unsigned i, cell t) {
+		unsigned sh = (i & 3) * 5;
+		raw[i >> 2] = (raw[i >> 2] & ~(line(0x1f) << sh)) | (line(t & 0x1f) << sh);
+	}
+
+	/**
+	 * get or set a packed row (r = 0 ~ 3) in the 20-bit form
+	 */
+	line fetch(unsigned r) const { return raw[r]; }
+	void assign(unsigned r, line l) { raw[r] = l; }
+
+	/**
+	 * get or set a packed column (c = 0 ~ 3) in the 20-bit form, with the top tile in the lowest bits
+	 */
+	line column(unsigned c) const {
+		unsigned sh = c * 5;
+		return ((raw[0] >> sh) & 0x1f) | (((raw[1] >> sh) & 0x1f) << 5) | (((raw[2] >> sh) & 0x1f) << 10) | (((raw[3] >> sh) & 0x1f) << 15);
+	}
+	void column(unsigned c, line l) {
+		unsigned sh = c * 5;
+		line mask = ~(line(0x1f) << sh);
+		raw[0] = (raw[0] & mask) | ((l & 0x1f) << sh);
+		raw[1] = (raw[1] & mask) | (((l >> 5) & 0x1f) << sh);
+		raw[2] = (raw[2] & mask) | (((l >> 10) & 0x1f) << sh);
+		raw[3] = (raw[3] & mask) | (((l >> 15) & 0x1f) << sh);
+	}
+
+	/**
+	 * the empty cells as a 16-bit mask, bit i is set if cell i (1-d form index) is empty
+	 */
+	uint32_t empty_mask() const {
+		uint32_t mask = 0;
+		for (int r = 0; r < 4; r++) {
+			line l = raw[r];
+			line e = ~(l | (l >> 1) | (l >> 2) | (l >> 3) | (l >> 4)) & 0x8421; // the lowest bit of each empty tile
+			mask |= ((e | (e >> 4) | (e >> 8) | (e >> 12)) & 0xf) << (r * 4);
+		}
+		return mask;
+	}
+
+	/**
+	 * the largest tile (index value) on the board
+	 */
+	cell max_tile() const {
+		cell max = 0;
+		for (int i = 0; i < 16; i++) max = std::max(max, operator()(i));
+		return max;
+	}
+
+	/**
+	 * 64-bit hash of the tiles, for transposition tables
+	 */
+	uint64_t hash() const {
+		uint64_t h = uint64_t(raw[0]) | (uint64_t(raw[1]) << 20) | (uint64_t(raw[2]) << 40);
+		h ^= (uint64_t(raw[3]) + 0x9e3779b97f4a7c15ull) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+		return h ^ (h >> 31);
+	}
 
 	data info() const { return attr; }
 	data info(data dat) { data old = attr; attr = dat; return old; }
 
 public:
-	bool operator ==(const board& b) const { return tile == b.tile; }
-	bool operator < (const board& b) const { return tile <  b.tile; }
+	bool operator ==(const board& b) const { return raw == b.raw; }
+	bool operator < (const board& b) const { return raw <  b.raw; }
 	bool operator !=(const board& b) const { return !(*this == b); }
 	bool operator > (const board& b) const { return b < *this; }
 	bool operator <=(const board& b) const { return !(b < *this); }
@@ -73,7 +145,7 @@ public:
 	reward place(unsigned pos, cell tile) {
 		if (pos >= 16) return -1;
 		if (tile != 1 && tile != 2) return -1;
-		operator()(pos) = tile;
+		set(pos, tile);
 		return 0;
 	}
 
@@ -92,72 +164,64 @@ public:
 	}
 
 	reward slide_left() {
-		board prev = *this;
 		reward score = 0;
+		line diff = 0;
 		for (int r = 0; r < 4; r++) {
-			auto& row = tile[r];
-			int top = 0, hold = 0;
-			for (int c = 0; c < 4; c++) {
-				int tile = row[c];
-				if (tile == 0) continue;
-				row[c] = 0;
-				if (hold) {
-					if ((std::abs(tile - hold) == 1) || (tile == 1 && hold == 1)) {
-						tile = std::max(tile, hold) + 1;
-						row[top++] = tile;
-						score += fib(tile);
-						hold = 0;
-					} else {
-						row[top++] = hold;
-						hold = tile;
-					}
-				} else {
-					hold = tile;
-				}
-			}
-			if (hold) tile[r][top] = hold;
+			const lookup::entry& e = lookup::left(raw[r]);
+			diff |= raw[r] ^ e.raw;
+			raw[r] = e.raw;
+			score += e.score;
 		}
-		return (*this != prev) ? score : -1;
+		return diff ? score : -1;
 	}
 	reward slide_right() {
-		reflect_horizontal();
-		reward score = slide_left();
-		reflect_horizontal();
-		return score;
+		reward score = 0;
+		line diff = 0;
+		for (int r = 0; r < 4; r++) {
+			const lookup::entry& e = lookup::right(raw[r]);
+			diff |= raw[r] ^ e.raw;
+			raw[r] = e.raw;
+			score += e.score;
+		}
+		return diff ? score : -1;
 	}
 	reward slide_up() {
-		rotate_right();
-		reward score = slide_right();
-		rotate_left();
-		return score;
+		reward score = 0;
+		line diff = 0;
+		for (int c = 0; c < 4; c++) {
+			line col = column(c);
+			const lookup::entry& e = lookup::left(col);
+			diff |= col ^ e.raw;
+			column(c, e.raw);
+			score += e.score;
+		}
+		return diff ? score : -1;
 	}
 	reward slide_down() {
-		rotate_right();
-		reward score = slide_left();
-		rotate_left();
-		return score;
+		reward score = 0;
+		line diff = 0;
+		for (int c = 0; c < 4; c++) {
+			line col = column(c);
+			const lookup::entry& e = lookup::right(col);
+			diff |= col ^ e.raw;
+			column(c, e.raw);
+			score += e.score;
+		}
+		return diff ? score : -1;
 	}
 
 	void transpose() {
-		for (int r = 0; r < 4; r++) {
-			for (int c = r + 1; c < 4; c++) {
-				std::swap(tile[r][c], tile[c][r]);
-			}
-		}
+		packed t = { column(0), column(1), column(2), column(3) };
+		raw = t;
 	}
 
 	void reflect_horizontal() {
-		for (int r = 0; r < 4; r++) {
-			std::swap(tile[r][0], tile[r][3]);
-			std::swap(tile[r][1], tile[r][2]);
-		}
+		for (int r = 0; r < 4; r++) raw[r] = lookup::reverse(raw[r]);
 	}
 
 	void reflect_vertical() {
-		for (int c = 0; c < 4; c++) {
-			std::swap(tile[0][c], tile[3][c]);
-			std::swap(tile[1][c], tile[2][c]);
-		}
+		std::swap(raw[0], raw[3]);
+		std::swap(raw[1], raw[2]);
 	}
 
 	/**
@@ -177,12 +241,79 @@ public:
 	void rotate_left() { transpose(); reflect_vertical(); } // counterclockwise
 	void reverse() { reflect_horizontal(); reflect_vertical(); }
 
+public:
+	/**
+	 * precomputed sliding results of all 2^20 packed rows
+	 *
+	 * left(l) and right(l) give the packed row after sliding l to the left and to the right,
+	 * together with the reward of the slide; columns use the same tables,
+	 * where sliding up is sliding left and sliding down is sliding right
+	 */
+	struct lookup {
+		struct entry {
+			line raw;
+			reward score;
+		};
+
+		static const entry& left(line l) { return tables().lt[l]; }
+		static const entry& right(line l) { return tables().rt[l]; }
+
+		static line reverse(line l) {
+			return ((l & 0x1f) << 15) | (((l >> 5) & 0x1f) << 10) | (((l >> 10) & 0x1f) << 5) | (l >> 15);
+		}
+
+	private:
+		std::vector<entry> lt, rt;
+
+		lookup() : lt(1 << 20), rt(1 << 20) {
+			for (line l = 0; l < (1u << 20); l++) {
+				int row[4] = { int(l & 0x1f), int((l >> 5) & 0x1f), int((l >> 10) & 0x1f), int(l >> 15) };
+				reward score = mvleft(row);
+				lt[l] = { line(row[0] | (row[1] << 5) | (row[2] << 10) | (row[3] << 15)), score };
+			}
+			for (line l = 0; l < (1u << 20); l++) {
+				const entry& e = lt[reverse(l)];
+				rt[l] = { reverse(e.raw), e.score };
+			}
+		}
+
+		static reward mvleft(int row[]) {
+			reward score = 0;
+			int top = 0, hold = 0;
+			for (int c = 0; c < 4; c++) {
+				int tile = row[c];
+				if (tile == 0) continue;
+				row[c] = 0;
+				if (hold) {
+					if ((std::abs(tile - hold) == 1) || (tile == 1 && hold == 1)) {
+						tile = std::min(std::max(tile, hold) + 1, 31);
+						row[top++] = tile;
+						score += fib(tile);
+						hold = 0;
+					} else {
+						row[top++] = hold;
+						hold = tile;
+					}
+				} else {
+					hold = tile;
+				}
+			}
+			if (hold) row[top] = hold;
+			return score;
+		}
+
+		static const lookup& tables() {
+			static const lookup cache;
+			return cache;
+		}
+	};
+
 public:
 	friend std::ostream& operator <<(std::ostream& out, const board& b) {
 		out << "+------------------------+" << std::endl;
-		for (auto& row : b.tile) {
+		for (int r = 0; r < 4; r++) {
 			out << "|" << std::dec;
-			for (auto t : row) out << std::setw(6) << (t == 0 ? t : fib(t));
+			for (auto t : b[r]) out << std::setw(6) << (t == 0 ? t : fib(t));
 			out << "|" << std::endl;
 		}
 		out << "+------------------------+" << std::endl;
@@ -191,13 +322,14 @@ public:
 	friend std::istream& operator >>(std::istream& in, board& b) {
 		for (int i = 0; i < 16; i++) {
 			while (!std::isdigit(in.peek()) && in.good()) in.ignore(1);
-			in >> b(i);
-			b(i) = std::log2(b(i));
+			cell t;
+			in >> t;
+			b.set(i, std::log2(t));
 		}
 		return in;
 	}
 
 private:
-	grid tile;
+	packed raw;
 	data attr;
 };
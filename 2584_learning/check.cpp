@@ -0,0 +1,46 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * check.cpp: Consistency checks of the weight formats
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "network.h"
+
+/**
+ * pack len entries (as deltas against base if given) in the compressed format of network::deflate,
+ * and check whether they are unpacked back to the same entries
+ */
+template<typename word>
+bool round_trip(size_t len, bool delta) {
+	std::vector<word> table(len), base(len), back(len);
+	for (size_t i = 0; i < len; i++) {
+		table[i] = (i % 7 == 0 || i + 1 == len) ? word(i * 2654435761u) : 0;
+		base[i] = (i % 5 == 0) ? table[i] : word(i);
+	}
+	const word* ref = delta ? base.data() : nullptr;
+	std::vector<char> packed;
+	network::pack<word>(table.data(), ref, len, packed);
+	return network::unpack<word>(packed, ref, back.data(), len) && back == table;
+}
+
+int main(int argc, const char* argv[]) {
+	// the sizes cover whole groups of 4096 entries, and a last group of a single block, of partial blocks,
+	// and of 4033 ~ 4095 entries (e.g., 4073 as in a 21^6 table), whose blocks fill all the 64 bits of its mask
+	size_t sizes[] = { 1, 64, 4096, 4096 * 3 + 1, 4096 * 3 + 100, 4096 * 3 + 4033, 4096 * 3 + 4073, 4096 * 3 + 4095 };
+	int failed = 0;
+	for (size_t len : sizes) {
+		for (bool delta : { false, true }) {
+			std::string what = std::to_string(len) + " entries" + (delta ? " as deltas" : "");
+			if (!round_trip<uint32_t>(len, delta)) std::cerr << "float tables of " << what << " do not round-trip" << std::endl, failed++;
+			if (!round_trip<uint16_t>(len, delta)) std::cerr << "int16 tables of " << what << " do not round-trip" << std::endl, failed++;
+		}
+	}
+	std::cout << (failed ? "FAILED" : "OK") << std::endl;
+	return failed ? 1 : 0;
+}
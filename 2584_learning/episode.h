@@ -15,6 +15,7 @@
 #include <sstream>
 #include <chrono>
 #include <numeric>
+#include <cstdint>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
@@ -24,7 +25,7 @@ class statistic;
 class episode {
 friend class statistic;
 public:
-	episode() : ep_state(initial_state()), ep_score(0), ep_time(0) { ep_moves.reserve(10000); }
+	episode() : ep_state(initial_state()), ep_score(0), ep_time(0), ep_learn(0) {}
 
 public:
 	board& state() { return ep_state; }
@@ -40,12 +41,12 @@ public:
 	bool apply_action(action move) {
 		board::reward reward = move.apply(state());
 		if (reward == -1) return false;
-		ep_moves.emplace_back(move, reward, millisec() - ep_time);
+		ep_moves.emplace_back(move, reward, nanosec() - ep_time);
 		ep_score += reward;
 		return true;
 	}
 	agent& take_turns(agent& play, agent& evil) {
-		ep_time = millisec();
+		ep_time = nanosec();
 		return (std::max(step() + 1, size_t(2)) % 2) ? play : evil;
 	}
 	agent& last_turns(agent& play, agent& evil) {
@@ -62,7 +63,19 @@ public:
 		}
 	}
 
+	/**
+	 * the time in ms taken by the moves of who, or by the whole episode
+	 */
 	time_t time(unsigned who = -1u) const {
+		if (who == action::slide::type || who == action::place::type) return nanos(who) / 1000000;
+		return ep_close.when - ep_open.when;
+	}
+
+	/**
+	 * the time in ns taken by the moves of who (action::slide::type or action::place::type),
+	 * each of which is measured by the steady clock from the start of the turn to the applied move
+	 */
+	time_t nanos(unsigned who) const {
 		time_t time = 0;
 		size_t i = 2;
 		switch (who) {
@@ -72,13 +85,16 @@ public:
 		case action::slide::type:
 			while (i < ep_moves.size()) time += ep_moves[i].time, i += 2;
 			break;
-		default:
-			time = ep_close.when - ep_open.when;
-			break;
 		}
 		return time;
 	}
 
+	/**
+	 * get or set the time in ns taken by the player to learn from the episode after it ended (e.g., the TD updates)
+	 */
+	time_t learn_time() const { return ep_learn; }
+	void learn_time(time_t ns) { ep_learn = ns; }
+
 	std::vector<action> actions(unsigned who = -1u) const {
 		std::vector<action> res;
 		size_t i = 2;
@@ -120,6 +136,94 @@ public:
 		return in;
 	}
 
+public:
+	/**
+	 * append the moves in the compact form, where each move is one byte, optionally followed by varints:
+	 * the low 6 bits are a placement (0 ~ 31, the position + 16 if the tile is 2) or a slide (32 + opcode),
+	 * or 63 for any other action, whose code follows; bit 6 and bit 7 are set if the reward and the time follow,
+	 * where the time is the step of its ns in the log scale of scale(), so that a move up to 262 us takes one byte
+	 */
+	void encode(std::vector<uint8_t>& out) const {
+		for (const move& mv : ep_moves) {
+			unsigned code = mv.code, kind = 63;
+			if (mv.code.type() == action::place::type && action::place(mv.code).tile() - 1u < 2u) {
+				kind = action::place(mv.code).position() | ((action::place(mv.code).tile() - 1) << 4);
+			} else if (mv.code.type() == action::slide::type && mv.code.event() < 4) {
+				kind = 32 | mv.code.event();
+			}
+			out.push_back(kind | (mv.reward ? 0x40 : 0) | (mv.time ? 0x80 : 0));
+			if (kind == 63) varint(out, code);
+			if (mv.reward) varint(out, uint64_t(mv.reward));
+			if (mv.time) varint(out, scale(uint64_t(mv.time)));
+		}
+	}
+
+	/**
+	 * the times of moves in the compact form are in a log scale of 8 steps per power of 2 (i.e., at most 12.5% apart),
+	 * the same as the latency histograms of statistic; scale(ns) is the step of a time in ns,
+	 * and span(step) is the middle of the times in that step, which is taken as the time of a decoded move
+	 */
+	static uint64_t scale(uint64_t ns) {
+		unsigned e = 63 - __builtin_clzll(ns | 1);
+		return e < 3 ? ns : (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+	}
+	static uint64_t span(uint64_t step) {
+		if (step < 8) return step;
+		unsigned shift = (step >> 3) - 1;
+		return (uint64_t(8 | (step & 7)) << shift) + ((uint64_t(1) << shift) >> 1);
+	}
+
+	/**
+	 * replace the moves by those in the compact form (see encode), and replay them from the initial state;
+	 * the times are in the log scale of encode, or are multiplied by unit if given (e.g., 1000000 for data recorded in ms)
+	 * returns false if the data is malformed or a move cannot be applied
+	 */
+	bool decode(const uint8_t* data, size_t size, time_t unit = 0) {
+		ep_state = initial_state();
+		ep_score = 0;
+		ep_moves.clear();
+		return parse(data, size, [&](const move& mv) {
+			if (mv.code.apply(ep_state) != mv.reward) return false;
+			ep_moves.emplace_back(mv.code, mv.reward, mv.time);
+			ep_score += mv.reward;
+			return true;
+		}, unit);
+	}
+
+	/**
+	 * call visit(move) for each move in the compact form, without replaying them, whose times are in ns as in decode;
+	 * returns false if the data is malformed or visit returns false
+	 */
+	template<typename visitor>
+	static bool parse(const uint8_t* data, size_t size, visitor visit, time_t unit = 0) {
+		const uint8_t* end = data + size;
+		while (data < end) {
+			unsigned kind = *data & 63, flag = *data++;
+			uint64_t code = 0, reward = 0, time = 0;
+			if (kind == 63 && !varint(data, end, code)) return false;
+			if (flag & 0x40 && !varint(data, end, reward)) return false;
+			if (flag & 0x80 && !varint(data, end, time)) return false;
+			if (kind >= 36 && kind != 63) return false;
+			action act = kind < 32 ? action::place(kind & 15, (kind >> 4) + 1) : kind < 36 ? action::slide(kind & 3) : action(code);
+			if (!visit(move(act, board::reward(reward), time_t(unit ? time * unit : span(time))))) return false;
+		}
+		return true;
+	}
+
+protected:
+	static void varint(std::vector<uint8_t>& out, uint64_t v) {
+		for (; v >= 0x80; v >>= 7) out.push_back(uint8_t(v) | 0x80);
+		out.push_back(uint8_t(v));
+	}
+	static bool varint(const uint8_t*& data, const uint8_t* end, uint64_t& v) {
+		v = 0;
+		for (unsigned shift = 0; data < end && shift < 64; shift += 7) {
+			v |= uint64_t(*data & 0x7f) << shift;
+			if ((*data++ & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
 protected:
 
 	struct move {
@@ -132,7 +236,7 @@ protected:
 		friend std::ostream& operator <<(std::ostream& out, const move& m) {
 			out << m.code;
 			if (m.reward) out << '[' << std::dec << m.reward << ']';
-			if (m.time) out << '(' << std::dec << m.time << ')';
+			if (m.time / 1000000) out << '(' << std::dec << (m.time / 1000000) << ')'; // in ms
 			return out;
 		}
 		friend std::istream& operator >>(std::istream& in, move& m) {
@@ -147,6 +251,7 @@ protected:
 			if (in.peek() == '(') {
 				in.ignore(1);
 				in >> std::dec >> m.time;
+				m.time *= 1000000;
 				in.ignore(1);
 			}
 			return in;
@@ -174,12 +279,43 @@ protected:
 		return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
 	}
 
+public:
+	static time_t nanosec() {
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+	}
+
 private:
 	board ep_state;
 	board::reward ep_score;
 	std::vector<move> ep_moves;
-	time_t ep_time;
+	time_t ep_time; // the start of the current turn in ns
+	time_t ep_learn;
 
 	meta ep_open;
 	meta ep_close;
 };
+
+/**
+ * play an episode between the player and the environment, and return its record
+ */
+inline episode play_episode(agent& play, agent& evil) {
+	play.open_episode("~:" + evil.name());
+	evil.open_episode(play.name() + ":~");
+
+	episode game;
+	game.open_episode(play.name() + ":" + evil.name());
+	while (true) {
+		agent& who = game.take_turns(play, evil);
+		action move = who.take_action(game.state());
+		if (game.apply_action(move) != true) break;
+		if (who.check_for_win(game.state())) break;
+	}
+	agent& win = game.last_turns(play, evil);
+	game.close_episode(win.name());
+	time_t learn = episode::nanosec();
+	play.close_episode(win.name());
+	game.learn_time(episode::nanosec() - learn);
+	evil.close_episode(win.name());
+	return game;
+}
@@ -0,0 +1,140 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * ledger.h: Counters of the episodes played by several processes
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <string>
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <numeric>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "board.h"
+#include "action.h"
+#include "episode.h"
+
+/**
+ * running totals of the episodes played by all trainers of a shared network,
+ * kept in a POSIX shared memory object so that a coordinator can report them
+ *
+ * trainers record each finished episode, and the coordinator reads the totals
+ * and reports the difference between two readings as a block
+ */
+class ledger {
+public:
+	/**
+	 * the totals at the time of a reading
+	 */
+	struct tally {
+		uint64_t games = 0;
+		uint64_t score = 0;
+		uint64_t best = 0;
+		uint64_t steps[2] = {}; // slides and placements
+		uint64_t times[2] = {}; // in milliseconds
+		uint64_t tiles[32] = {}; // the number of games ending with each largest tile
+	};
+
+public:
+	/**
+	 * open (or create) the ledger of the shared network name, i.e., the object name + ".ledger"
+	 */
+	ledger(const std::string& name) : name(name + ".ledger"), book(nullptr) {
+		int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT, 0600);
+		void* addr = fd < 0 || ftruncate(fd, sizeof(counters)) != 0 ? MAP_FAILED :
+				mmap(nullptr, sizeof(counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (fd >= 0) close(fd);
+		if (addr == MAP_FAILED) {
+			std::cerr << "cannot open ledger: " << this->name << std::endl;
+			std::exit(-1);
+		}
+		book = static_cast<counters*>(addr); // a new object is zero-filled, which is a valid empty ledger
+	}
+	ledger(const ledger&) = delete;
+	ledger& operator =(const ledger&) = delete;
+	~ledger() { munmap(book, sizeof(counters)); }
+
+	void record(const episode& ep) {
+		book->score += ep.score();
+		for (uint64_t best = book->best; uint64_t(ep.score()) > best && !book->best.compare_exchange_weak(best, ep.score()); );
+		book->steps[0] += ep.step(action::slide::type);
+		book->steps[1] += ep.step(action::place::type);
+		book->times[0] += ep.time(action::slide::type);
+		book->times[1] += ep.time(action::place::type);
+		book->tiles[ep.state().max_tile() & 31]++;
+		book->games++; // last, so that a reading never counts a game whose totals are missing
+	}
+
+	tally read() const {
+		tally now;
+		now.games = book->games;
+		now.score = book->score;
+		now.best = book->best;
+		for (int i = 0; i < 2; i++) now.steps[i] = book->steps[i], now.times[i] = book->times[i];
+		for (int t = 0; t < 32; t++) now.tiles[t] = book->tiles[t];
+		return now;
+	}
+
+	/**
+	 * show the games between two readings in the format of statistic::show,
+	 * except that max is the largest score since the ledger was created
+	 */
+	static void show(const tally& last, const tally& now) {
+		uint64_t blk = now.games - last.games;
+		if (blk == 0) return;
+		uint64_t pop = now.steps[0] - last.steps[0], eop = now.steps[1] - last.steps[1];
+		uint64_t pdu = now.times[0] - last.times[0], edu = now.times[1] - last.times[1];
+
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << now.games << "\t";
+		std::cout << "avg = " << ((now.score - last.score) / blk) << ", ";
+		std::cout << "max = " << (now.best) << ", ";
+		std::cout << "ops = " << ((pop + eop) * 1000.0 / (pdu + edu));
+		std::cout <<     " (" << (pop * 1000.0 / pdu);
+		std::cout <<      "|" << (eop * 1000.0 / edu) << ")";
+		std::cout << std::endl;
+		std::cout.copyfmt(ff);
+
+		uint64_t stat[32];
+		for (int t = 0; t < 32; t++) stat[t] = now.tiles[t] - last.tiles[t];
+		for (uint64_t t = 0, c = 0; c < blk; c += stat[t++]) {
+			if (stat[t] == 0) continue;
+			uint64_t accu = std::accumulate(std::begin(stat) + t, std::end(stat), uint64_t(0));
+			std::cout << "\t" << fib(t); // type
+			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
+			std::cout << "\t" "(" << (stat[t] * 100.0 / blk) << "%" ")"; // percentage of ending
+			std::cout << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+	/**
+	 * remove the object, the processes which still have it open are unaffected
+	 */
+	void unlink() const {
+		shm_unlink(name.c_str());
+	}
+
+private:
+	struct counters {
+		std::atomic<uint64_t> games;
+		std::atomic<uint64_t> score;
+		std::atomic<uint64_t> best;
+		std::atomic<uint64_t> steps[2];
+		std::atomic<uint64_t> times[2];
+		std::atomic<uint64_t> tiles[32];
+	};
+
+	std::string name;
+	counters* book;
+};
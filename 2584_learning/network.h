@@ -0,0 +1,1058 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * network.h: Table-driven n-tuple network
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "board.h"
+#include "weight.h"
+
+/**
+ * n-tuple network described by a list of patterns
+ *
+ * each pattern is a tuple of cells (1-d form index) together with the table it looks up,
+ * several patterns may share one table; the index of a pattern on a board is the
+ * base-25 number formed by the tiles of its cells, with the first cell as the most significant digit
+ *
+ * the encoding can be changed by a layout: tiles can be capped by a bound (per network or per pattern)
+ * to shrink the tables, digits can be packed by bit shifts instead of multiplications,
+ * and tables larger than a given capacity can be hashed into that capacity (colliding indexes share an entry)
+ *
+ * the indexes of all patterns on a board are computed once into an index buffer,
+ * which is then reused for both evaluation and update
+ */
+class network {
+public:
+	typedef uint32_t index;
+	static constexpr size_t limit = 64; // max number of patterns, i.e., the size of an index buffer
+	static constexpr index radix = 25;
+
+	/**
+	 * a bound of 0 follows the bound of the layout; tiles not below the bound are treated as (bound - 1)
+	 */
+	struct pattern {
+		std::vector<unsigned> cells;
+		uint32_t table;
+		index bound;
+		pattern(std::initializer_list<unsigned> cells, uint32_t table, index bound = 0) : cells(cells), table(table), bound(bound) {}
+	};
+
+	/**
+	 * bound: the default tile bound of patterns, i.e., the radix of the digits
+	 * shift: pack each digit into the fewest bits holding the bound, so a table has 2^(bits * length) entries
+	 * hash: if nonzero, tables that would exceed 2^hash entries are hashed into 2^hash entries
+	 */
+	struct layout {
+		index bound;
+		bool shift;
+		unsigned hash;
+		layout(index bound = radix, bool shift = false, unsigned hash = 0) : bound(bound), shift(shift), hash(hash) {}
+	};
+
+	/**
+	 * how the tables are allocated (tables of a mapped weight file are not affected)
+	 * huge: back the tables by huge pages, with page = 0 for transparent huge pages,
+	 *       or 21 (2M) / 30 (1G) for explicit huge pages, falling back to transparent ones if none are reserved
+	 * interleave: interleave the pages of the tables across all NUMA nodes (Linux only)
+	 */
+	struct policy {
+		bool huge;
+		unsigned page;
+		bool interleave;
+		policy(bool huge = false, unsigned page = 0, bool interleave = false) : huge(huge), page(page), interleave(interleave) {}
+	};
+
+public:
+	network() : plain(true), gather(false) {}
+	network(const network& n) : feature(n.feature), shape(n.shape), tops(n.tops), plain(n.plain), net(n.net), quant(n.quant), scale(n.scale), alloc(n.alloc) { bind(); } // the copy owns its tables even if n is mapped
+	network(network&& n) = default;
+	network& operator =(const network& n) {
+		feature = n.feature;
+		shape = n.shape;
+		tops = n.tops;
+		plain = n.plain;
+		net = n.net;
+		quant = n.quant;
+		scale = n.scale;
+		release();
+		bind();
+		return *this;
+	}
+	network& operator =(network&& n) = default;
+	network(const std::vector<pattern>& patterns, const layout& lay = layout()) : feature(patterns), plain(true), gather(false) {
+		if (feature.size() > limit) {
+			std::cerr << "too many patterns: " << feature.size() << " > " << limit << std::endl;
+			std::exit(-1);
+		}
+		for (pattern& p : feature) {
+			if (p.bound == 0) p.bound = lay.bound;
+			if (p.bound < 2 || p.bound > 32) {
+				std::cerr << "invalid tile bound: " << p.bound << std::endl;
+				std::exit(-1);
+			}
+			if (std::find(tops.begin(), tops.end(), p.bound - 1) == tops.end()) tops.push_back(p.bound - 1);
+			unsigned slot = std::find(tops.begin(), tops.end(), p.bound - 1) - tops.begin();
+			coding c = { slot, lay.shift ? 32 - index(__builtin_clz(p.bound - 1)) : 0, 0 };
+			shape.push_back(c);
+		}
+		if (lay.hash > 32) {
+			std::cerr << "invalid hash bits: " << lay.hash << std::endl;
+			std::exit(-1);
+		}
+		for (size_t t = 0, n = dense(t); n; n = dense(++t)) {
+			if (lay.hash == 0 || n <= (size_t(1) << lay.hash)) continue;
+			for (size_t i = 0; i < feature.size(); i++) {
+				if (feature[i].table == t) shape[i].hash = lay.hash;
+			}
+		}
+		for (size_t i = 0; i < feature.size(); i++) plain &= (feature[i].bound == radix && shape[i].bits == 0 && shape[i].hash == 0);
+	}
+
+	/**
+	 * expand each base pattern into its 8 isomorphisms (4 rotations, each optionally reflected),
+	 * all of which share the table of the base pattern
+	 *
+	 * the cell mapping of each isomorphism is taken from a board whose i-th cell holds i,
+	 * so no board has to be rotated during evaluation
+	 */
+	static std::vector<pattern> isomorphic(const std::vector<pattern>& base) {
+		std::vector<pattern> expand;
+		for (int i = 0; i < 8; i++) {
+			board iso;
+			for (int c = 0; c < 16; c++) iso.set(c, c);
+			if (i >= 4) iso.reflect_horizontal();
+			iso.rotate(i);
+			for (const pattern& p : base) {
+				pattern q = p;
+				for (unsigned& c : q.cells) c = iso(c);
+				expand.push_back(q);
+			}
+		}
+		return expand;
+	}
+
+	/**
+	 * the number of patterns, i.e., the number of indexes per board
+	 */
+	size_t size() const { return feature.size(); }
+	const std::vector<pattern>& patterns() const { return feature; }
+
+	/**
+	 * set the allocation policy of the tables allocated afterward
+	 */
+	void allocate_by(const policy& p) { alloc = p; }
+
+	/**
+	 * the number of tables, and the number of entries of table t
+	 */
+	size_t tables() const { return quantized() ? quant.size() : net.size(); }
+	size_t entries(size_t t) const { return quantized() ? quant[t].size() : net[t].size(); }
+
+	/**
+	 * allocate zero-initialized tables, sized by the longest pattern of each table
+	 */
+	void init() {
+		net.clear();
+		quant.clear();
+		scale.clear();
+		release();
+		for (size_t t = 0, n = required(t); n; n = required(++t)) net.push_back(allocate<weight>(n));
+		bind();
+	}
+
+	/**
+	 * the number of entries table t should have, or 0 if no pattern uses table t
+	 */
+	size_t required(size_t t) const {
+		for (size_t i = 0; i < feature.size(); i++) {
+			if (feature[i].table == t && shape[i].hash) return size_t(1) << shape[i].hash;
+		}
+		return dense(t);
+	}
+
+	/**
+	 * the number of entries table t would have without hashing, or 0 if no pattern uses table t
+	 */
+	size_t dense(size_t t) const {
+		size_t len = 0;
+		for (size_t i = 0; i < feature.size(); i++) {
+			if (feature[i].table != t) continue;
+			size_t n = 1;
+			for (size_t k = 0; k < feature[i].cells.size(); k++) n *= shape[i].bits ? (size_t(1) << shape[i].bits) : feature[i].bound;
+			len = std::max(len, n);
+		}
+		return len;
+	}
+
+	/**
+	 * the fraction of nonzero entries of table t, or an estimate from every stride-th entry
+	 */
+	double occupancy(size_t t, size_t stride = 1) const {
+		if (entries(t) == 0) return 0;
+		if (stride > 1) {
+			size_t seen = 0, used = 0;
+			for (size_t i = 0; i < entries(t); i += stride, seen++) used += quantized() ? quant[t][i] != 0 : net[t][i] != 0;
+			return double(used) / seen;
+		}
+		size_t used = entries(t);
+		if (quantized()) used -= std::count(quant[t].data(), quant[t].data() + used, qweight::type(0));
+		else used -= std::count(net[t].data(), net[t].data() + used, weight::type(0));
+		return double(used) / entries(t);
+	}
+
+public:
+	/**
+	 * compute the indexes of all patterns on board b into idx[0 ~ size() - 1]
+	 */
+	void indexes(const board& b, index* idx) const {
+		index tile[32][16]; // the tiles capped by each distinct bound
+		for (size_t t = 0; t < tops.size(); t++) {
+			for (int i = 0; i < 16; i++) tile[t][i] = std::min(index(b(i)), tops[t]);
+		}
+		if (plain) {
+			// the default layout, in which the radix is a constant
+			for (const pattern& p : feature) {
+				index i = 0;
+				for (unsigned x : p.cells) i = i * radix + tile[0][x];
+				*(idx++) = i;
+			}
+			return;
+		}
+		for (size_t k = 0; k < feature.size(); k++) {
+			const pattern& p = feature[k];
+			const coding& c = shape[k];
+			const index* cap = tile[c.slot];
+			index i = 0;
+			if (c.bits) {
+				for (unsigned x : p.cells) i = (i << c.bits) | cap[x];
+			} else {
+				for (unsigned x : p.cells) i = i * p.bound + cap[x];
+			}
+			if (c.hash) i = index((i * 0x9e3779b97f4a7c15ull) >> (64 - c.hash));
+			*(idx++) = i;
+		}
+	}
+
+	float estimate(const index* idx) const {
+		float value = 0;
+		if (quantized()) {
+			for (size_t k = 0; k < qbase.size(); k++) value += qbase[k][idx[k]] * qscale[k];
+			return value;
+		}
+		for (const weight::type* w : base) value += w[*(idx++)];
+		return value;
+	}
+
+	void update(const index* idx, float adjust) {
+		for (weight::type* w : base) weight::add(w[*(idx++)], adjust);
+	}
+
+	float estimate(const board& b) const {
+		index idx[limit];
+		indexes(b, idx);
+		return estimate(idx);
+	}
+
+	/**
+	 * compute the values of n boards
+	 *
+	 * boards are processed in groups of 8, whose indexes are stored pattern-major (structure of arrays)
+	 * so that each pattern of a group is read by one AVX2 gather if supported;
+	 * the entries of the next group are prefetched before the current group is summed,
+	 * so that the memory latency of the large tables overlaps across groups
+	 */
+	void estimate(const board* b, size_t n, float* value) const {
+		if (n == 0) return;
+		index soa[2][limit][group];
+		size_t count[2] = { 0, 0 };
+		count[0] = gather_indexes(b, n, soa[0]);
+		for (size_t i = 0, cur = 0; i < n; i += group, cur ^= 1) {
+			if (i + group < n) count[cur ^ 1] = gather_indexes(b + i + group, n - i - group, soa[cur ^ 1]);
+			estimate_group(soa[cur], count[cur], value + i);
+		}
+	}
+
+	/**
+	 * prefetch the entries of an index buffer, to be issued as soon as the indexes are known
+	 */
+	void prefetch(const index* idx) const {
+		if (quantized()) {
+			for (size_t k = 0; k < qbase.size(); k++) __builtin_prefetch(qbase[k] + idx[k]);
+			return;
+		}
+		for (size_t k = 0; k < base.size(); k++) __builtin_prefetch(base[k] + idx[k]);
+	}
+
+	/**
+	 * compute the values of 4 index buffers (e.g., the afterstates of the 4 slides) at once,
+	 * with one AVX2 gather per pattern if supported, or one by one otherwise;
+	 * the values are identical to those of estimate(idx) since each lane sums in the same order
+	 */
+	void estimate(const index (*idx)[limit], float* value) const {
+#if defined(__x86_64__) || defined(__i386__)
+		static const bool avx2 = __builtin_cpu_supports("avx2");
+		if (avx2 && gather) {
+			estimate_gather(idx, value);
+			return;
+		}
+#endif
+		for (int i = 0; i < 4; i++) value[i] = estimate(idx[i]);
+	}
+
+public:
+	/**
+	 * the weight file (version 2) consists of
+	 * a header { "TCGW", version, number of tables, 0 },
+	 * a directory of { offset, number of entries, scale, entry type } for each table,
+	 * and the entries of each table, stored at a page-aligned offset so that a mapped file can be used in place
+	 *
+	 * files of version 1 (whose directory has only offsets and sizes of float tables)
+	 * and of the unversioned format (the number of tables followed by the tables) can still be read
+	 */
+	struct header {
+		char magic[4];
+		uint32_t version;
+		uint32_t count;
+		uint32_t reserved;
+	};
+	struct directory {
+		uint64_t offset;
+		uint64_t size;
+		float scale;
+		uint32_t type; // 0 for float, 1 for int16
+	};
+
+	friend std::ostream& operator <<(std::ostream& out, const network& n) {
+		header head = { { 'T', 'C', 'G', 'W' }, 2, uint32_t(n.tables()), 0 };
+		uint64_t end;
+		std::vector<directory> dir = n.layout_of(end);
+		out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+		out.write(reinterpret_cast<const char*>(dir.data()), sizeof(directory) * dir.size());
+		uint64_t pos = sizeof(header) + sizeof(directory) * n.tables();
+		for (size_t t = 0; t < n.tables(); t++) {
+			for (; pos < dir[t].offset; pos++) out.put(0);
+			const char* data = n.quantized() ? reinterpret_cast<const char*>(n.quant[t].data()) : reinterpret_cast<const char*>(n.net[t].data());
+			size_t len = dir[t].size * (n.quantized() ? sizeof(qweight::type) : sizeof(weight::type));
+			out.write(data, len);
+			pos += len;
+		}
+		return out;
+	}
+	friend std::istream& operator >>(std::istream& in, network& n) {
+		header head = {};
+		in.read(reinterpret_cast<char*>(&head), sizeof(head.magic));
+		if (std::memcmp(head.magic, "TCGZ", sizeof(head.magic)) == 0) {
+			in.seekg(-std::streamoff(sizeof(head.magic)), std::ios::cur);
+			n.inflate(in);
+			return in;
+		}
+		n.net.clear();
+		n.quant.clear();
+		n.scale.clear();
+		n.release();
+		if (std::memcmp(head.magic, "TCGW", sizeof(head.magic)) == 0) {
+			in.read(reinterpret_cast<char*>(&head) + sizeof(head.magic), sizeof(head) - sizeof(head.magic));
+			std::vector<directory> dir(head.count);
+			uint64_t pos = sizeof(header);
+			for (directory& d : dir) {
+				in.read(reinterpret_cast<char*>(&d), entry(head.version));
+				pos += entry(head.version);
+				if (head.version == 1) d.scale = 1, d.type = 0;
+			}
+			for (const directory& d : dir) {
+				if (d.type != dir[0].type) {
+					std::cerr << "mixed table types are not supported" << std::endl;
+					std::exit(-1);
+				}
+				in.ignore(d.offset - pos);
+				char* data;
+				if (d.type == 1) {
+					n.quant.push_back(n.allocate<qweight>(d.size));
+					n.scale.push_back(d.scale);
+					data = reinterpret_cast<char*>(n.quant.back().data());
+				} else {
+					n.net.push_back(n.allocate<weight>(d.size));
+					data = reinterpret_cast<char*>(n.net.back().data());
+				}
+				in.read(data, d.size * width(d.type));
+				pos = d.offset + d.size * width(d.type);
+			}
+		} else {
+			uint32_t size;
+			std::memcpy(&size, head.magic, sizeof(size));
+			for (uint32_t t = 0; t < size; t++) {
+				uint64_t len = 0;
+				in.read(reinterpret_cast<char*>(&len), sizeof(len));
+				n.net.push_back(n.allocate<weight>(len));
+				in.read(reinterpret_cast<char*>(n.net.back().data()), sizeof(weight::type) * len);
+			}
+		}
+		n.bind();
+		return in;
+	}
+
+	/**
+	 * map a weight file (version 1 or 2) and use its tables in place, returns false if the file is of another format
+	 *
+	 * a read-only mapping is shared by all processes evaluating the same file through the page cache;
+	 * a writable private mapping is copy-on-write, i.e., updates stay in this process until the weights are saved;
+	 * a writable shared mapping writes updates back to the file, see sync()
+	 */
+	bool map(const std::string& path, bool writable, bool shared) {
+		int fd = open(path.c_str(), writable && shared ? O_RDWR : O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "cannot open weight file: " << path << std::endl;
+			std::exit(-1);
+		}
+		return map(fd, path, writable, shared);
+	}
+
+	/**
+	 * use the tables of the POSIX shared memory object name (e.g., "/tcg2584"), with updates visible to all processes
+	 * attached to it; returns false if there is no such object
+	 *
+	 * the object is laid out as a weight file, whose header is written last by share(),
+	 * so an object still being created is waited for; with wait, an object not yet created is waited for as well
+	 */
+	bool attach(const std::string& name, bool wait = false) {
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		for (int retry = 0; fd < 0 && wait && errno == ENOENT && retry < 600; retry++) {
+			usleep(100000);
+			fd = shm_open(name.c_str(), O_RDWR, 0);
+		}
+		if (fd < 0) return false;
+		for (int retry = 0; retry < 600; retry++) {
+			header head = {};
+			if (pread(fd, &head, sizeof(head), 0) == ssize_t(sizeof(head)) && std::memcmp(head.magic, "TCGW", sizeof(head.magic)) == 0) {
+				if (!map(fd, name, true, true)) break;
+				return true;
+			}
+			usleep(100000);
+		}
+		std::cerr << "invalid shared weights: " << name << std::endl;
+		std::exit(-1);
+	}
+
+	/**
+	 * move the current (float) tables into a new POSIX shared memory object name, or attach to it if it already exists
+	 */
+	void share(const std::string& name) {
+		if (quantized()) {
+			std::cerr << "quantized weights cannot be shared" << std::endl;
+			std::exit(-1);
+		}
+		if (tables() == 0) {
+			std::cerr << "no tables to share, use init or load" << std::endl;
+			std::exit(-1);
+		}
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST && attach(name)) return;
+		uint64_t len;
+		std::vector<directory> dir = layout_of(len);
+		void* addr = fd < 0 || ftruncate(fd, len) != 0 ? MAP_FAILED : mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			std::cerr << "cannot create shared weights: " << name << std::endl;
+			std::exit(-1);
+		}
+		char* base = static_cast<char*>(addr);
+		std::memcpy(base + sizeof(header), dir.data(), sizeof(directory) * dir.size());
+		for (size_t t = 0; t < net.size(); t++) std::memcpy(base + dir[t].offset, net[t].data(), sizeof(weight::type) * net[t].size());
+		header head = { { 'T', 'C', 'G', 'W' }, 2, uint32_t(net.size()), 0 };
+		std::memcpy(base, &head, sizeof(head));
+		munmap(addr, len);
+		map(fd, name, true, true);
+	}
+
+	/**
+	 * map the weight file fd (closed afterward) as in map(path, writable, shared)
+	 */
+	bool map(int fd, const std::string& path, bool writable, bool shared) {
+		struct stat st;
+		header head = {};
+		if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(header) ||
+				pread(fd, &head, sizeof(head), 0) != ssize_t(sizeof(head)) ||
+				std::memcmp(head.magic, "TCGW", sizeof(head.magic)) != 0 || entry(head.version) == 0) {
+			close(fd);
+			return false;
+		}
+		size_t len = st.st_size;
+		void* addr = mmap(nullptr, len, PROT_READ | (writable ? PROT_WRITE : 0), shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED) {
+			std::cerr << "cannot map weight file: " << path << std::endl;
+			std::exit(-1);
+		}
+		mapping = std::make_shared<region>(addr, len, writable, writable && shared);
+
+		char* base = static_cast<char*>(addr);
+		if (sizeof(header) + entry(head.version) * uint64_t(head.count) > len) {
+			std::cerr << "truncated weight file: " << path << std::endl;
+			std::exit(-1);
+		}
+		net.clear();
+		quant.clear();
+		scale.clear();
+		memory.clear();
+		for (uint32_t t = 0; t < head.count; t++) {
+			directory d = { 0, 0, 1, 0 };
+			std::memcpy(&d, base + sizeof(header) + entry(head.version) * t, entry(head.version));
+			if (head.version == 1) d.scale = 1, d.type = 0;
+			if (d.offset % alignof(weight::type) || d.offset + d.size * width(d.type) > len) {
+				std::cerr << "truncated weight file: " << path << std::endl;
+				std::exit(-1);
+			}
+			if (d.type == 1) {
+				quant.emplace_back(reinterpret_cast<qweight::type*>(base + d.offset), d.size);
+				scale.push_back(d.scale);
+			} else {
+				net.emplace_back(reinterpret_cast<weight::type*>(base + d.offset), d.size);
+			}
+		}
+		if (net.size() && quant.size()) {
+			std::cerr << "mixed table types are not supported" << std::endl;
+			std::exit(-1);
+		}
+		bind();
+		return true;
+	}
+
+	/**
+	 * the directory of the current tables in the weight file layout, and the end of the last table
+	 */
+	std::vector<directory> layout_of(uint64_t& end) const {
+		std::vector<directory> dir;
+		uint64_t pos = sizeof(header) + sizeof(directory) * tables();
+		for (size_t t = 0; t < tables(); t++) {
+			pos = aligned(pos);
+			if (quantized()) {
+				dir.push_back({ pos, quant[t].size(), scale[t], 1 });
+				pos += sizeof(qweight::type) * quant[t].size();
+			} else {
+				dir.push_back({ pos, net[t].size(), 1, 0 });
+				pos += sizeof(weight::type) * net[t].size();
+			}
+		}
+		end = pos;
+		return dir;
+	}
+
+	/**
+	 * write the updates of a writable shared mapping back to its file, returns false if there is no such mapping
+	 */
+	bool sync() {
+		if (!mapping || !mapping->writeback) return false;
+		return msync(mapping->addr, mapping->len, MS_SYNC) == 0;
+	}
+
+	/**
+	 * whether the tables view a mapping whose updates are written back to a file or a shared memory object
+	 */
+	bool writeback() const {
+		return mapping && mapping->writeback;
+	}
+
+	/**
+	 * whether the tables view a weight file mapped read-only, whose entries cannot be updated
+	 */
+	bool readonly() const {
+		return mapping && !mapping->writable;
+	}
+
+public:
+	/**
+	 * replace the float tables by int16 tables, each scaled by its largest magnitude;
+	 * a quantized network is for evaluation only and cannot be updated
+	 */
+	void quantize() {
+		if (quantized()) return;
+		size_t stale = memory.size(); // the allocations of the float tables
+		for (const weight& w : net) {
+			float top = 0;
+			for (size_t i = 0; i < w.size(); i++) top = std::max(top, std::abs(w[i]));
+			float s = top > 0 ? top / 32767 : 1;
+			qweight q = allocate<qweight>(w.size());
+			for (size_t i = 0; i < w.size(); i++) q[i] = qweight::type(std::lround(w[i] / s));
+			quant.push_back(std::move(q));
+			scale.push_back(s);
+		}
+		net.clear();
+		mapping.reset();
+		memory.erase(memory.begin(), memory.begin() + stale);
+		bind();
+	}
+
+	bool quantized() const { return quant.size(); }
+
+public:
+	/**
+	 * the compressed weight file consists of
+	 * a header { "TCGZ", version 1, number of tables, 1 if the tables are deltas or 0 otherwise },
+	 * a directory of { number of entries, bytes of payload, scale, entry type } for each table,
+	 * and the payload of each table, where each block of 64 entries is stored as a 64-bit mask of its nonzero entries
+	 * followed by these entries, and each group of 64 blocks is led by a 64-bit mask of its blocks that are stored,
+	 * so that the entries never visited (which stay 0) cost at most 1 bit each
+	 *
+	 * a delta file stores the entries XORed bitwise with those of a base network (e.g., an earlier checkpoint),
+	 * so that the unchanged entries are 0 as well; it is lossless, but can only be inflated with the same base
+	 */
+	struct packed {
+		uint64_t size;
+		uint64_t bytes;
+		float scale;
+		uint32_t type; // 0 for float, 1 for int16
+	};
+
+	/**
+	 * write the tables in the compressed format, as deltas if origin is given; the tables are packed in parallel
+	 */
+	void deflate(std::ostream& out, const network* origin = nullptr) const {
+		if (origin) fits(*origin, *this);
+		header head = { { 'T', 'C', 'G', 'Z' }, 1, uint32_t(tables()), origin ? 1u : 0u };
+		std::vector<std::vector<char>> payload(tables());
+		parallel([&](size_t t) {
+			if (quantized()) {
+				pack<uint16_t>(quant[t].data(), origin ? origin->quant[t].data() : nullptr, quant[t].size(), payload[t]);
+			} else {
+				pack<uint32_t>(net[t].data(), origin ? origin->net[t].data() : nullptr, net[t].size(), payload[t]);
+			}
+		});
+		out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+		for (size_t t = 0; t < tables(); t++) {
+			packed d = { entries(t), payload[t].size(), quantized() ? scale[t] : 1, quantized() ? 1u : 0u };
+			out.write(reinterpret_cast<const char*>(&d), sizeof(d));
+		}
+		for (const std::vector<char>& data : payload) out.write(data.data(), data.size());
+	}
+
+	/**
+	 * read the tables in the compressed format, whose deltas are applied to origin; the tables are unpacked in parallel
+	 * a weight file of other formats is read as usual (origin is then ignored)
+	 */
+	void inflate(std::istream& in, const network* origin = nullptr) {
+		header head = {};
+		in.read(reinterpret_cast<char*>(&head), sizeof(head));
+		if (std::memcmp(head.magic, "TCGZ", sizeof(head.magic)) != 0) {
+			in.clear();
+			in.seekg(-std::streamoff(in.gcount()), std::ios::cur);
+			in >> *this;
+			return;
+		}
+		if (head.version != 1) {
+			std::cerr << "unsupported compressed weights: version " << head.version << std::endl;
+			std::exit(-1);
+		}
+		if (head.reserved & 1 && !origin) {
+			std::cerr << "delta weights cannot be read without their base" << std::endl;
+			std::exit(-1);
+		}
+		if (!(head.reserved & 1)) origin = nullptr;
+		std::vector<packed> dir(head.count);
+		in.read(reinterpret_cast<char*>(dir.data()), sizeof(packed) * dir.size());
+		net.clear();
+		quant.clear();
+		scale.clear();
+		release();
+		std::vector<std::vector<char>> payload(head.count);
+		for (uint32_t t = 0; t < head.count && in; t++) {
+			if (dir[t].type != dir[0].type) {
+				std::cerr << "mixed table types are not supported" << std::endl;
+				std::exit(-1);
+			}
+			if (dir[t].type == 1) {
+				quant.push_back(allocate<qweight>(dir[t].size));
+				scale.push_back(dir[t].scale);
+			} else {
+				net.push_back(allocate<weight>(dir[t].size));
+			}
+			payload[t].resize(dir[t].bytes);
+			in.read(payload[t].data(), payload[t].size());
+		}
+		if (!in) {
+			std::cerr << "truncated compressed weights" << std::endl;
+			std::exit(-1);
+		}
+		if (origin) fits(*origin, *this);
+		std::atomic<bool> broken(false);
+		parallel([&](size_t t) {
+			bool valid;
+			if (quantized()) {
+				valid = unpack<uint16_t>(payload[t], origin ? origin->quant[t].data() : nullptr, quant[t].data(), quant[t].size());
+			} else {
+				valid = unpack<uint32_t>(payload[t], origin ? origin->net[t].data() : nullptr, net[t].data(), net[t].size());
+			}
+			if (!valid) broken = true;
+			std::vector<char>().swap(payload[t]);
+		});
+		if (broken) {
+			std::cerr << "corrupted compressed weights" << std::endl;
+			std::exit(-1);
+		}
+		bind();
+	}
+
+private:
+	/**
+	 * check whether the tables of a delta base have the same types and sizes as those of n
+	 */
+	static void fits(const network& origin, const network& n) {
+		bool fit = origin.tables() == n.tables() && origin.quantized() == n.quantized();
+		for (size_t t = 0; fit && t < n.tables(); t++) fit = origin.entries(t) == n.entries(t);
+		if (!fit) {
+			std::cerr << "the base does not fit the delta weights" << std::endl;
+			std::exit(-1);
+		}
+	}
+
+	/**
+	 * run work(t) for each table t on all cores, the largest tables first
+	 */
+	template<typename job>
+	void parallel(job work) const {
+		std::vector<size_t> order(tables());
+		for (size_t t = 0; t < order.size(); t++) order[t] = t;
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return entries(a) > entries(b); });
+		std::atomic<size_t> next(0);
+		auto worker = [&]() { for (size_t i; (i = next++) < order.size(); ) work(order[i]); };
+		size_t threads = std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), order.size());
+		std::vector<std::thread> pool;
+		for (size_t i = 1; i < threads; i++) pool.emplace_back(worker);
+		worker();
+		for (std::thread& th : pool) th.join();
+	}
+
+public:
+	/**
+	 * append the blocks of len entries (viewed as words, XORed with ref if given) to out, see deflate()
+	 */
+	template<typename word>
+	static void pack(const void* src, const void* ref, size_t len, std::vector<char>& out) {
+		const char* from = static_cast<const char*>(src);
+		const char* base = static_cast<const char*>(ref);
+		std::vector<char> group;
+		for (size_t g = 0; g < len; g += 4096) {
+			uint64_t used = 0; // the blocks of this group having nonzero entries
+			group.clear();
+			for (size_t b = 0, i = g; b < 64 && i < len; b++, i += 64) {
+				size_t n = std::min(len - i, size_t(64));
+				uint64_t mask = 0;
+				word kept[64];
+				size_t k = 0;
+				for (size_t j = 0; j < n; j++) {
+					word w, r = 0;
+					std::memcpy(&w, from + (i + j) * sizeof(word), sizeof(word));
+					if (base) std::memcpy(&r, base + (i + j) * sizeof(word), sizeof(word));
+					if (w ^ r) mask |= uint64_t(1) << j, kept[k++] = w ^ r;
+				}
+				if (mask == 0) continue;
+				used |= uint64_t(1) << b;
+				size_t at = group.size();
+				group.resize(at + sizeof(mask) + sizeof(word) * k);
+				std::memcpy(&group[at], &mask, sizeof(mask));
+				std::memcpy(&group[at + sizeof(mask)], kept, sizeof(word) * k);
+			}
+			const char* head = reinterpret_cast<const char*>(&used);
+			out.insert(out.end(), head, head + sizeof(used));
+			out.insert(out.end(), group.begin(), group.end());
+		}
+	}
+
+	/**
+	 * restore len entries from the blocks in src (XORed with ref if given) into dst, returns false if src is malformed
+	 */
+	template<typename word>
+	static bool unpack(const std::vector<char>& src, const void* ref, void* dst, size_t len) {
+		const char* base = static_cast<const char*>(ref);
+		char* to = static_cast<char*>(dst);
+		size_t pos = 0;
+		for (size_t g = 0; g < len; g += 4096) {
+			size_t n = std::min(len - g, size_t(4096));
+			uint64_t used;
+			if (pos + sizeof(used) > src.size()) return false;
+			std::memcpy(&used, &src[pos], sizeof(used));
+			pos += sizeof(used);
+			if (base) std::memcpy(to + g * sizeof(word), base + g * sizeof(word), sizeof(word) * n);
+			else std::memset(to + g * sizeof(word), 0, sizeof(word) * n);
+			size_t blocks = (n + 63) / 64;
+			if (blocks < 64 && (used >> blocks)) return false;
+			for (; used; used &= used - 1) {
+				size_t i = g + 64 * __builtin_ctzll(used);
+				uint64_t mask;
+				if (pos + sizeof(mask) > src.size()) return false;
+				std::memcpy(&mask, &src[pos], sizeof(mask));
+				pos += sizeof(mask);
+				if ((len - i < 64 && (mask >> (len - i))) || pos + sizeof(word) * __builtin_popcountll(mask) > src.size()) return false;
+				for (; mask; mask &= mask - 1) {
+					size_t j = i + __builtin_ctzll(mask);
+					word w, r = 0;
+					std::memcpy(&w, &src[pos], sizeof(word));
+					pos += sizeof(word);
+					if (base) std::memcpy(&r, base + j * sizeof(word), sizeof(word));
+					w ^= r;
+					std::memcpy(to + j * sizeof(word), &w, sizeof(word));
+				}
+			}
+		}
+		return pos == src.size();
+	}
+
+private:
+	/**
+	 * cache the table address of each pattern, should be called whenever the tables are (re)allocated
+	 */
+	void bind() {
+		base.clear();
+		qbase.clear();
+		qscale.clear();
+		gather = !quantized();
+		for (size_t t = 0; t < tables(); t++) gather &= (entries(t) <= (size_t(1) << 31)); // gathers take signed indexes
+		if (tables() == 0 && mapping) {
+			std::cerr << "no tables in the mapped weights" << std::endl;
+			std::exit(-1);
+		}
+		if (tables() == 0) return;
+		for (const pattern& p : feature) {
+			if (p.table >= tables() || entries(p.table) < required(p.table)) {
+				std::cerr << "table " << p.table << " does not fit the patterns" << std::endl;
+				std::exit(-1);
+			}
+			if (quantized()) {
+				qbase.push_back(quant[p.table].data());
+				qscale.push_back(scale[p.table]);
+			} else {
+				base.push_back(net[p.table].data());
+			}
+		}
+	}
+
+	/**
+	 * allocate a zero-initialized table by the allocation policy,
+	 * which owns its entries if no policy is given, or views an anonymous mapping otherwise
+	 */
+	template<typename table>
+	table allocate(size_t len) {
+		if (!alloc.huge && !alloc.interleave) return table(len);
+		size_t bytes = sizeof(typename table::type) * len;
+		void* addr = reserve(bytes);
+		return table(static_cast<typename table::type*>(addr), len);
+	}
+
+	void* reserve(size_t bytes) {
+		const size_t huge = size_t(1) << (alloc.page ? alloc.page : 21);
+		void* addr = MAP_FAILED;
+		size_t len = (bytes + huge - 1) / huge * huge;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+		if (alloc.huge && alloc.page) {
+			addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (alloc.page << MAP_HUGE_SHIFT), -1, 0);
+			if (addr == MAP_FAILED) {
+				std::cerr << "no explicit huge pages of 2^" << alloc.page << " bytes, use transparent huge pages" << std::endl;
+				alloc.page = 0;
+			}
+		}
+#endif
+		void* start = addr;
+		if (addr == MAP_FAILED) {
+			// over-allocate so that the tables can start at a huge page boundary
+			len = (bytes + huge - 1) / huge * huge + huge;
+			addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (addr == MAP_FAILED) {
+				std::cerr << "cannot allocate " << bytes << " bytes for the tables" << std::endl;
+				std::exit(-1);
+			}
+			start = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(addr) + huge - 1) / huge * huge);
+#if defined(MADV_HUGEPAGE)
+			if (alloc.huge) madvise(start, len - huge, MADV_HUGEPAGE);
+#endif
+		}
+#if defined(__linux__) && defined(SYS_mbind)
+		if (alloc.interleave) {
+			const unsigned long interleave = 3; // MPOL_INTERLEAVE
+			std::vector<unsigned long> nodes = possible_nodes();
+			unsigned long bits = sizeof(unsigned long) * 8 * nodes.size();
+			if (syscall(SYS_mbind, start, (bytes + huge - 1) / huge * huge, interleave, nodes.data(), bits + 1, 0) != 0) { // the kernel takes maxnode - 1 bits
+				std::cerr << "cannot interleave the tables across NUMA nodes" << std::endl;
+			}
+		}
+#endif
+		memory.push_back(std::make_shared<region>(addr, len, true, false));
+		return start;
+	}
+
+	/**
+	 * the mask of the possible NUMA nodes, as listed in /sys/devices/system/node/possible (e.g., "0-3,5"),
+	 * or of node 0 only if the list cannot be read; a mask beyond these nodes is rejected by kernels with fewer nodes
+	 */
+	static std::vector<unsigned long> possible_nodes() {
+		const size_t width = sizeof(unsigned long) * 8;
+		std::vector<unsigned long> mask;
+		std::ifstream in("/sys/devices/system/node/possible");
+		std::string list;
+		std::getline(in, list);
+		std::stringstream ss(list);
+		for (std::string range; std::getline(ss, range, ','); ) {
+			unsigned first = 0, last = 0;
+			int n = std::sscanf(range.c_str(), "%u-%u", &first, &last);
+			if (n < 1) continue;
+			if (n < 2) last = first;
+			for (unsigned node = first; node <= last && node < 4096; node++) {
+				if (mask.size() <= node / width) mask.resize(node / width + 1, 0);
+				mask[node / width] |= 1ul << (node % width);
+			}
+		}
+		if (mask.empty()) mask.push_back(1);
+		return mask;
+	}
+
+	/**
+	 * release the mapped weight file and the allocations, should be called only after the tables are cleared
+	 */
+	void release() {
+		mapping.reset();
+		memory.clear();
+	}
+
+	static constexpr size_t group = 8; // the number of boards summed together by estimate(b, n, value)
+
+	/**
+	 * compute the indexes of up to 8 boards into soa[pattern][board], prefetch their entries,
+	 * and return the number of boards; unused lanes are filled with index 0
+	 */
+	size_t gather_indexes(const board* b, size_t n, index (*soa)[group]) const {
+		n = std::min(n, size_t(group));
+		index idx[limit];
+		for (size_t j = 0; j < group; j++) {
+			if (j < n) {
+				indexes(b[j], idx);
+				prefetch(idx);
+			} else {
+				std::fill(idx, idx + size(), 0);
+			}
+			for (size_t k = 0; k < size(); k++) soa[k][j] = idx[k];
+		}
+		return n;
+	}
+
+	void estimate_group(const index (*soa)[group], size_t n, float* value) const {
+#if defined(__x86_64__) || defined(__i386__)
+		static const bool avx2 = __builtin_cpu_supports("avx2");
+		if (avx2 && gather) {
+			float sum[group];
+			estimate_gather(soa, sum);
+			std::copy(sum, sum + n, value);
+			return;
+		}
+#endif
+		for (size_t j = 0; j < n; j++) {
+			float v = 0;
+			if (quantized()) {
+				for (size_t k = 0; k < qbase.size(); k++) v += qbase[k][soa[k][j]] * qscale[k];
+			} else {
+				for (size_t k = 0; k < base.size(); k++) v += base[k][soa[k][j]];
+			}
+			value[j] = v;
+		}
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__attribute__((target("avx2")))
+	void estimate_gather(const index (*soa)[group], float* value) const {
+		__m256 sum = _mm256_setzero_ps();
+		for (size_t k = 0; k < base.size(); k++) {
+			__m256i i = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(soa[k]));
+			sum = _mm256_add_ps(sum, _mm256_i32gather_ps(base[k], i, sizeof(weight::type)));
+		}
+		_mm256_storeu_ps(value, sum);
+	}
+
+	__attribute__((target("avx2")))
+	void estimate_gather(const index (*idx)[limit], float* value) const {
+		__m128 sum = _mm_setzero_ps();
+		for (size_t k = 0; k < base.size(); k++) {
+			__m128i i = _mm_setr_epi32(idx[0][k], idx[1][k], idx[2][k], idx[3][k]);
+			sum = _mm_add_ps(sum, _mm_i32gather_ps(base[k], i, sizeof(weight::type)));
+		}
+		_mm_storeu_ps(value, sum);
+	}
+#endif
+
+	/**
+	 * the size of a directory entry of the given file version, or 0 if the version is unknown
+	 */
+	static size_t entry(uint32_t version) {
+		switch (version) {
+		case 1: return sizeof(uint64_t) * 2;
+		case 2: return sizeof(directory);
+		default: return 0;
+		}
+	}
+
+	static size_t width(uint32_t type) {
+		return type == 1 ? sizeof(qweight::type) : sizeof(weight::type);
+	}
+
+	/**
+	 * the resolved encoding of a pattern: the slot of its largest digit in tops, the bits per digit (0 for radix mode),
+	 * and the bits of the hashed index (0 if not hashed)
+	 */
+	struct coding {
+		unsigned slot;
+		index bits;
+		unsigned hash;
+	};
+
+	static uint64_t aligned(uint64_t pos) {
+		const uint64_t page = 4096;
+		return (pos + page - 1) / page * page;
+	}
+
+	struct region {
+		void* addr;
+		size_t len;
+		bool writable;
+		bool writeback;
+		region(void* addr, size_t len, bool writable, bool writeback) : addr(addr), len(len), writable(writable), writeback(writeback) {}
+		~region() { munmap(addr, len); }
+	};
+
+private:
+	std::vector<pattern> feature;
+	std::vector<coding> shape;
+	std::vector<index> tops; // the distinct largest digits of the patterns
+	bool plain; // whether all patterns use the default layout
+	bool gather; // whether the tables can be read by gathers, see bind()
+	std::vector<weight> net;
+	std::vector<weight::type*> base;
+	std::vector<qweight> quant; // the int16 tables if quantized, in which case net is empty
+	std::vector<float> scale;
+	std::vector<const qweight::type*> qbase;
+	std::vector<float> qscale;
+	std::shared_ptr<region> mapping; // the mapped weight file viewed by the tables, if any
+	std::vector<std::shared_ptr<region>> memory; // the allocations viewed by the tables, if any
+	policy alloc;
+};
@@ -8,7 +8,14 @@
  */
 
 #pragma once
-#include <list>
+#include <vector>
+#include <numeric>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <functional>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
@@ -16,6 +23,7 @@
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
+#include "telemetry.h"
 
 class statistic {
 public:
@@ -30,7 +38,10 @@ public:
 		: total(total),
 		  block(block ? block : total),
 		  limit(limit ? limit : total),
-		  count(0) {}
+		  count(0),
+		  oldest(0),
+		  sink(nullptr),
+		  since(episode::nanosec()) {}
 
 public:
 	/**
@@ -38,6 +49,7 @@ public:
 	 *
 	 * the format would be
 	 * 1000   avg = 273901, max = 382324, ops = 241563 (170543|896715)
+	 *        p50/p99/max (ns): player 5632/11264/409600, environment 704/1408/28160, learn 1310720/2883584/9437184
 	 *        512     100%   (0.3%)
 	 *        1024    99.7%  (0.2%)
 	 *        2048    99.5%  (1.1%)
@@ -52,105 +64,406 @@ public:
 	 *  'ops = 241563 (170543|896715)': the average speed is 241563
 	 *                                  the average speed of player is 170543
 	 *                                  the average speed of environment is 896715
+	 *  'p50/p99/max (ns): ...': the latency percentiles of the moves of the player and the environment,
+	 *                           and of the learning of the player after each episode (e.g., the TD updates)
 	 *  '93.7%': 93.7% (937 games) reached 8192-tiles (a.k.a. win rate of 8192-tile)
 	 *  '22.4%': 22.4% (224 games) terminated with 8192-tiles (the largest)
 	 */
 	void show(bool tstat = true) const {
-		size_t blk = std::min(data.size(), block);
-		size_t stat[64] = { 0 };
-		size_t sop = 0, pop = 0, eop = 0;
-		time_t sdu = 0, pdu = 0, edu = 0;
-		board::reward sum = 0, max = 0;
-		auto it = data.end();
-		for (size_t i = 0; i < blk; i++) {
-			auto& ep = *(--it);
-			sum += ep.score();
-			max = std::max(ep.score(), max);
-			stat[*std::max_element(&(ep.state()(0)), &(ep.state()(16)))]++;
-			sop += ep.step();
-			pop += ep.step(action::slide::type);
-			eop += ep.step(action::place::type);
-			sdu += ep.time();
-			pdu += ep.time(action::slide::type);
-			edu += ep.time(action::place::type);
-		}
-
-		std::ios ff(nullptr);
-		ff.copyfmt(std::cout);
-		std::cout << std::fixed << std::setprecision(0);
-		std::cout << count << "\t";
-		std::cout << "avg = " << (sum / blk) << ", ";
-		std::cout << "max = " << (max) << ", ";
-		std::cout << "ops = " << (sop * 1000.0 / sdu);
-		std::cout <<     " (" << (pop * 1000.0 / pdu);
-		std::cout <<      "|" << (eop * 1000.0 / edu) << ")";
-		std::cout << std::endl;
-		std::cout.copyfmt(ff);
-
-		if (!tstat) return;
-		for (size_t t = 0, c = 0; c < blk; c += stat[t++]) {
-			if (stat[t] == 0) continue;
-			unsigned accu = std::accumulate(std::begin(stat) + t, std::end(stat), 0);
-			std::cout << "\t" << fib(t); // type
-			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
-			std::cout << "\t" "(" << (stat[t] * 100.0 / blk) << "%" ")"; // percentage of ending
-			std::cout << std::endl;
-		}
-		std::cout << std::endl;
+		show(recent, tstat);
 	}
 
+	/**
+	 * show the statistic of all retained games
+	 */
 	void summary() const {
-		auto block_temp = block;
-		const_cast<statistic&>(*this).block = data.size();
-		show();
-		const_cast<statistic&>(*this).block = block_temp;
+		tally all;
+		for (const record& rec : ring) all += rec;
+		show(all);
 	}
 
 	bool is_finished() const {
 		return count >= total;
 	}
 
+	/**
+	 * play an episode in place: open_episode starts back(), which close_episode then stores
+	 */
 	void open_episode(const std::string& flag = "") {
-		if (count++ >= limit) data.pop_front();
-		data.emplace_back();
-		data.back().open_episode(flag);
+		live = {};
+		live.open_episode(flag);
 	}
 
 	void close_episode(const std::string& flag = "") {
-		data.back().close_episode(flag);
-		if (count % block == 0) show();
+		live.close_episode(flag);
+		push_episode(live);
 	}
 
-	episode& at(size_t i) {
-		auto it = data.begin();
-		while (i--) it++;
-		return *it;
+	/**
+	 * append an episode which was played outside the statistic, e.g., by a worker thread
+	 * calls from multiple threads should be serialized by the caller
+	 */
+	void push_episode(const episode& ep) {
+		count++;
+		if (ring.size() < limit) {
+			ring.emplace_back();
+			ring.back().assign(ep);
+		} else {
+			ring[oldest].assign(ep);
+			oldest = (oldest + 1) % ring.size();
+		}
+		recent += ring[(oldest + ring.size() - 1) % ring.size()];
+		if (count % block == 0) {
+			show();
+			if (sink) emit(recent);
+			recent = {};
+			since = episode::nanosec();
+		}
 	}
-	episode& front() {
-		return data.front();
+
+	/**
+	 * also report each block to a telemetry sink (see emit), where extra appends the fields known only by the caller,
+	 * e.g., the memory usage; the sink should outlive the statistic
+	 */
+	void report(telemetry* to, const std::function<void(telemetry::record&)>& extra = nullptr) {
+		sink = to;
+		append = extra;
+	}
+
+	/**
+	 * the number of episodes still to be played
+	 */
+	size_t remain() const {
+		return total - std::min(total, count);
+	}
+
+	/**
+	 * the i-th retained episode (the oldest is 0), restored from its compact record
+	 */
+	episode at(size_t i) const {
+		return ring[(oldest + i) % ring.size()].restore();
+	}
+	episode front() const {
+		return at(0);
 	}
 	episode& back() {
-		return data.back();
+		return live;
 	}
 
 	friend std::ostream& operator <<(std::ostream& out, const statistic& stat) {
-		for (const episode& rec : stat.data) out << rec << std::endl;
+		for (size_t i = 0; i < stat.ring.size(); i++) out << stat.at(i) << std::endl;
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, statistic& stat) {
 		for (std::string line; std::getline(in, line) && line.size(); ) {
-			stat.data.emplace_back();
-			std::stringstream(line) >> stat.data.back();
+			episode ep;
+			std::stringstream(line) >> ep;
+			stat.ring.emplace_back();
+			stat.ring.back().assign(ep);
 		}
-		stat.total = std::max(stat.total, stat.data.size());
-		stat.count = stat.data.size();
+		stat.total = std::max(stat.total, stat.ring.size());
+		stat.limit = std::max(stat.limit, stat.ring.size());
+		stat.count = stat.ring.size();
+		stat.oldest = 0;
 		return in;
 	}
 
+public:
+	/**
+	 * the binary form of the statistic consists of
+	 * a header { "TCGE", version 3, number of episodes },
+	 * and a record for each episode (the oldest first), which are varints unless specified:
+	 * the opening tag (length, bytes) and time, the closing tag (length, bytes) and time,
+	 * the learning time in ns, and the moves in the compact form of episode::encode (length, bytes)
+	 *
+	 * logs of version 2 (whose moves are timed in ns rather than in the log scale of episode::scale)
+	 * and version 1 (whose moves are timed in ms, without the learning time) can still be read
+	 */
+	struct header {
+		char magic[4];
+		uint32_t version;
+		uint64_t count;
+	};
+
+	void write(std::ostream& out) const {
+		header head = { { 'T', 'C', 'G', 'E' }, 3, ring.size() };
+		out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+		std::vector<uint8_t> buf;
+		for (size_t i = 0; i < ring.size(); i++) {
+			const record& rec = ring[(oldest + i) % ring.size()];
+			buf.clear();
+			for (const episode::meta* m : { &rec.open, &rec.close }) {
+				episode::varint(buf, m->tag.size());
+				buf.insert(buf.end(), m->tag.begin(), m->tag.end());
+				episode::varint(buf, uint64_t(m->when));
+			}
+			episode::varint(buf, uint64_t(rec.learn));
+			episode::varint(buf, rec.moves.size());
+			buf.insert(buf.end(), rec.moves.begin(), rec.moves.end());
+			out.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+		}
+	}
+
+	/**
+	 * read the binary form, whose episodes are validated and replayed in parallel;
+	 * returns false (with the stream rewound) if the stream is not in the binary form
+	 */
+	bool read(std::istream& in) {
+		header head = {};
+		in.read(reinterpret_cast<char*>(&head), sizeof(head));
+		if (!in || std::memcmp(head.magic, "TCGE", sizeof(head.magic)) != 0 || head.version < 1 || head.version > 3) {
+			in.clear();
+			in.seekg(0);
+			return false;
+		}
+		std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+		// each record takes at least one byte for each of its varints, so a count beyond that is corrupted
+		const size_t least = head.version >= 2 ? 6 : 5;
+		if (head.count > data.size() / least) corrupted();
+
+		// locate the records, then restore them on all cores
+		std::vector<record> recs(head.count);
+		std::vector<std::pair<size_t, size_t>> moves(head.count);
+		const uint8_t* it = data.data();
+		const uint8_t* end = it + data.size();
+		for (record& rec : recs) {
+			for (episode::meta* m : { &rec.open, &rec.close }) {
+				uint64_t len, when;
+				if (!episode::varint(it, end, len) || uint64_t(end - it) < len) corrupted();
+				m->tag.assign(it, it + len);
+				it += len;
+				if (!episode::varint(it, end, when)) corrupted();
+				m->when = time_t(when);
+			}
+			uint64_t learn = 0, len;
+			if (head.version >= 2 && !episode::varint(it, end, learn)) corrupted();
+			rec.learn = time_t(learn);
+			if (!episode::varint(it, end, len) || uint64_t(end - it) < len) corrupted();
+			moves[&rec - recs.data()] = { size_t(it - data.data()), size_t(len) };
+			it += len;
+		}
+		const time_t unit = head.version >= 3 ? 0 : head.version == 2 ? 1 : 1000000; // the unit of the times of the moves in ns, 0 for the log scale
+		std::atomic<size_t> next(0);
+		std::atomic<bool> broken(false);
+		auto worker = [&]() {
+			episode ep;
+			for (size_t i; (i = next++) < recs.size(); ) {
+				const uint8_t* src = data.data() + moves[i].first;
+				if (!ep.decode(src, moves[i].second, unit)) {
+					broken = true;
+					continue;
+				}
+				ep.ep_open = recs[i].open;
+				ep.ep_close = recs[i].close;
+				ep.learn_time(recs[i].learn);
+				recs[i].describe(ep);
+				if (unit == 0) recs[i].moves.assign(src, src + moves[i].second);
+				else ep.encode(recs[i].moves);
+			}
+		};
+		std::vector<std::thread> pool;
+		for (size_t n = 1; n < std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), recs.size()); n++) pool.emplace_back(worker);
+		worker();
+		for (std::thread& th : pool) th.join();
+		if (broken) corrupted();
+
+		ring.insert(ring.end(), std::make_move_iterator(recs.begin()), std::make_move_iterator(recs.end()));
+		total = std::max(total, ring.size());
+		limit = std::max(limit, ring.size());
+		count = ring.size();
+		oldest = 0;
+		return true;
+	}
+
+private:
+	static void corrupted() {
+		std::cerr << "corrupted episode log" << std::endl;
+		std::exit(-1);
+	}
+
+private:
+	/**
+	 * a retained episode: its tags, the figures shown in the statistic, and its moves in the compact form (see episode::encode)
+	 * the buffers of a record are reused when the ring wraps around
+	 */
+	struct record {
+		episode::meta open, close;
+		board::reward score;
+		board::cell tile;
+		size_t steps[2]; // slides and placements
+		time_t times[3]; // slides and placements in ns, and the whole episode in ms
+		time_t learn; // in ns
+		std::vector<uint8_t> moves;
+
+		void assign(const episode& ep) {
+			open = ep.ep_open;
+			close = ep.ep_close;
+			describe(ep);
+			moves.clear();
+			ep.encode(moves);
+		}
+
+		void describe(const episode& ep) {
+			score = ep.score();
+			tile = ep.state().max_tile();
+			steps[0] = ep.step(action::slide::type);
+			steps[1] = ep.step(action::place::type);
+			times[0] = ep.nanos(action::slide::type);
+			times[1] = ep.nanos(action::place::type);
+			times[2] = ep.time();
+			learn = ep.learn_time();
+		}
+
+		episode restore() const {
+			episode ep;
+			ep.decode(moves.data(), moves.size());
+			ep.ep_open = open;
+			ep.ep_close = close;
+			ep.learn_time(learn);
+			return ep;
+		}
+	};
+
+	/**
+	 * a histogram of latencies in ns, with 8 bins per power of 2 (i.e., the bins are at most 12.5% apart)
+	 */
+	struct latency {
+		uint64_t bins[512] = {};
+		uint64_t count = 0;
+		uint64_t top = 0;
+
+		void add(uint64_t ns) {
+			bins[episode::scale(ns)]++;
+			count++;
+			top = std::max(top, ns);
+		}
+
+		/**
+		 * the lower bound of the bin holding the q-quantile
+		 */
+		uint64_t quantile(double q) const {
+			uint64_t rank = uint64_t(q * (count - 1)), seen = 0;
+			for (unsigned i = 0; i < 512; i++) {
+				seen += bins[i];
+				if (seen > rank) return i < 8 ? i : uint64_t(8 | (i & 7)) << ((i >> 3) - 1);
+			}
+			return top;
+		}
+	};
+
+	/**
+	 * the running totals of a set of games
+	 */
+	struct tally {
+		size_t games = 0;
+		int64_t sum = 0;
+		board::reward max = 0;
+		size_t stat[64] = {};
+		size_t sop = 0, pop = 0, eop = 0;
+		time_t sdu = 0, pdu = 0, edu = 0, ldu = 0;
+		latency player, environment, learn; // the moves of the player and the environment, and the learning of the player
+
+		tally& operator +=(const record& rec) {
+			episode::parse(rec.moves.data(), rec.moves.size(), [&](const episode::move& mv) {
+				(mv.code.type() == action::slide::type ? player : environment).add(mv.time);
+				return true;
+			});
+			learn.add(rec.learn);
+			ldu += rec.learn;
+			games++;
+			sum += rec.score;
+			max = std::max(rec.score, max);
+			stat[rec.tile]++;
+			pop += rec.steps[0];
+			eop += rec.steps[1];
+			sop += rec.steps[0] + rec.steps[1];
+			pdu += rec.times[0];
+			edu += rec.times[1];
+			sdu += rec.times[2];
+			return *this;
+		}
+	};
+
+	void show(const tally& t, bool tstat = true) const {
+		size_t blk = std::max(t.games, size_t(1));
+		const size_t* stat = t.stat;
+
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << count << "\t";
+		std::cout << "avg = " << (t.sum / int64_t(blk)) << ", ";
+		std::cout << "max = " << (t.max) << ", ";
+		std::cout << "ops = " << (t.sop * 1000.0 / t.sdu);
+		std::cout <<     " (" << (t.pop * 1e9 / t.pdu);
+		std::cout <<      "|" << (t.eop * 1e9 / t.edu) << ")";
+		std::cout << std::endl;
+		std::cout.copyfmt(ff);
+
+		if (!tstat) return;
+		std::cout << "\t" "p50/p99/max (ns): ";
+		const char* phases[] = { "player", "environment", "learn" };
+		const latency* lat[] = { &t.player, &t.environment, &t.learn };
+		for (int i = 0; i < 3; i++) {
+			std::cout << (i ? ", " : "") << phases[i] << " ";
+			std::cout << lat[i]->quantile(0.5) << "/" << lat[i]->quantile(0.99) << "/" << lat[i]->top;
+		}
+		std::cout << std::endl;
+		for (size_t i = 0, c = 0; c < t.games; c += stat[i++]) {
+			if (stat[i] == 0) continue;
+			size_t accu = std::accumulate(stat + i, stat + 64, size_t(0));
+			std::cout << "\t" << fib(i); // type
+			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
+			std::cout << "\t" "(" << (stat[i] * 100.0 / blk) << "%" ")"; // percentage of ending
+			std::cout << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+	/**
+	 * report the block to the sink: the games played, the average and maximum scores,
+	 * the games per second (wall clock), the moves per second (all|player|environment as in show),
+	 * the TD updates (i.e., moves of the player) per second of learning, the latency percentiles of each phase in ns,
+	 * and the win rate of each tile, followed by the extra fields
+	 */
+	void emit(const tally& t) const {
+		size_t blk = std::max(t.games, size_t(1));
+		telemetry::record rec = {
+			{ "games", double(count) },
+			{ "block", double(t.games) },
+			{ "avg", double(t.sum) / blk },
+			{ "max", double(t.max) },
+			{ "games_per_sec", t.games * 1e9 / std::max(episode::nanosec() - since, time_t(1)) },
+			{ "ops", t.sop * 1000.0 / std::max(t.sdu, time_t(1)) },
+			{ "player_ops", t.pop * 1e9 / std::max(t.pdu, time_t(1)) },
+			{ "environment_ops", t.eop * 1e9 / std::max(t.edu, time_t(1)) },
+			{ "updates_per_sec", t.pop * 1e9 / std::max(t.ldu, time_t(1)) },
+		};
+		const char* phases[] = { "player", "environment", "learn" };
+		const latency* lat[] = { &t.player, &t.environment, &t.learn };
+		for (int i = 0; i < 3; i++) {
+			rec.emplace_back(std::string(phases[i]) + "_p50", double(lat[i]->quantile(0.5)));
+			rec.emplace_back(std::string(phases[i]) + "_p99", double(lat[i]->quantile(0.99)));
+			rec.emplace_back(std::string(phases[i]) + "_max", double(lat[i]->top));
+		}
+		for (size_t i = 0, accu = t.games; i < 32; accu -= t.stat[i++]) { // accu is the number of games reaching tile i
+			if (i) rec.emplace_back("win_" + std::to_string(fib(i)), double(accu) / blk);
+		}
+		if (append) append(rec);
+		sink->emit(rec);
+	}
+
 private:
 	size_t total;
 	size_t block;
 	size_t limit;
 	size_t count;
-	std::list<episode> data;
+	std::vector<record> ring; // the latest 'limit' episodes, the oldest at ring[oldest]
+	size_t oldest;
+	tally recent; // the games of the current block
+	episode live; // the episode played in place, see open_episode
+	telemetry* sink;
+	std::function<void(telemetry::record&)> append;
+	time_t since; // the start of the current block in ns
 };
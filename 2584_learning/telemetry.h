@@ -0,0 +1,113 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * telemetry.h: Machine-readable reports of training runs
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * a sink of records, each of which is a list of named numbers, written as JSON lines or as CSV
+ * (whose header is taken from the first record) to a file, or to a Unix socket with "unix:/path/to/socket"
+ *
+ * the sink never blocks, so that it never stops a training: a record is dropped with a warning if the consumer
+ * (e.g., of a socket or a FIFO) does not keep up, and a sink that cannot be written is closed with a warning
+ */
+class telemetry {
+public:
+	typedef std::vector<std::pair<std::string, double>> record;
+
+public:
+	telemetry(const std::string& target, const std::string& format = "json") : csv(format == "csv"), headed(false), sock(false), lagging(false), fd(-1) {
+		if (target.find("unix:") == 0) {
+			std::string path = target.substr(target.find(":") + 1);
+			sockaddr_un addr = {};
+			addr.sun_family = AF_UNIX;
+			std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			sock = true;
+			if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+				close(fd);
+				fd = -1;
+			}
+		} else {
+			fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+			struct stat st;
+			headed = fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0; // appending to an existing CSV
+		}
+		if (fd < 0) std::cerr << "cannot open telemetry: " << target << std::endl;
+	}
+	telemetry(const telemetry&) = delete;
+	telemetry& operator =(const telemetry&) = delete;
+	~telemetry() { if (fd >= 0) close(fd); }
+
+	void emit(const record& rec) {
+		if (fd < 0) return;
+		std::ostringstream out;
+		out << std::setprecision(9);
+		if (csv) {
+			for (size_t i = 0; !headed && i < rec.size(); i++) out << (i ? "," : "") << rec[i].first << (i + 1 < rec.size() ? "" : "\n");
+			for (size_t i = 0; i < rec.size(); i++) out << (i ? "," : "") << rec[i].second;
+		} else {
+			out << "{";
+			for (size_t i = 0; i < rec.size(); i++) out << (i ? ", " : "") << "\"" << rec[i].first << "\": " << rec[i].second;
+			out << "}";
+		}
+		out << "\n";
+		std::string line = out.str();
+		for (size_t done = 0; done < line.size(); ) {
+			ssize_t n = sock ? ::send(fd, line.data() + done, line.size() - done, MSG_NOSIGNAL | MSG_DONTWAIT) : ::write(fd, line.data() + done, line.size() - done);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && done == 0) {
+				if (!lagging) std::cerr << "telemetry is not read fast enough, records are dropped" << std::endl;
+				lagging = true;
+				return;
+			}
+			if (n <= 0) { // including a line cut short, after which the stream would be malformed
+				std::cerr << "cannot write telemetry, stopped" << std::endl;
+				close(fd);
+				fd = -1;
+				return;
+			}
+			done += n;
+		}
+		headed = true;
+		lagging = false;
+	}
+
+	/**
+	 * the resident set size of this process in bytes
+	 */
+	static double rss() {
+		long pages = 0, resident = 0;
+		FILE* statm = std::fopen("/proc/self/statm", "r");
+		if (statm) {
+			if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+			std::fclose(statm);
+		}
+		return double(resident) * sysconf(_SC_PAGESIZE);
+	}
+
+private:
+	bool csv;
+	bool headed; // whether the CSV header has been written
+	bool sock;
+	bool lagging; // whether the last record was dropped, so that a run of drops is warned once
+	int fd;
+};
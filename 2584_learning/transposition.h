@@ -0,0 +1,76 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * transposition.h: Transposition table for searching over boards
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "board.h"
+
+/**
+ * fixed-size transposition table of 2^bits entries, keyed by board::hash()
+ *
+ * each entry keeps the value and the depth it was searched to;
+ * entries are read and written without locks (lockless hashing): the check word holds key ^ data,
+ * so an entry torn by concurrent writers fails the check and is treated as a miss
+ */
+class transposition {
+public:
+	transposition(unsigned bits = 0) : table(bits ? size_t(1) << bits : 0), mask(bits ? (uint64_t(1) << bits) - 1 : 0) {}
+
+	size_t size() const { return table.size(); }
+
+	/**
+	 * find the value of a board searched to at least the given depth
+	 */
+	bool find(const board& b, unsigned depth, float& value) const {
+		if (table.empty()) return false;
+		uint64_t key = b.hash();
+		const entry& e = table[key & mask];
+		uint64_t check = __atomic_load_n(&e.check, __ATOMIC_RELAXED);
+		uint64_t data = __atomic_load_n(&e.data, __ATOMIC_RELAXED);
+		if ((check ^ data) != key || uint32_t(data >> 32) < depth) return false;
+		uint32_t bits = uint32_t(data);
+		std::memcpy(&value, &bits, sizeof(value));
+		return true;
+	}
+
+	/**
+	 * store the value of a board searched to the given depth, replacing the entry in its slot
+	 */
+	void store(const board& b, unsigned depth, float value) {
+		if (table.empty()) return;
+		uint64_t key = b.hash();
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		uint64_t data = (uint64_t(depth) << 32) | bits;
+		entry& e = table[key & mask];
+		__atomic_store_n(&e.check, key ^ data, __ATOMIC_RELAXED);
+		__atomic_store_n(&e.data, data, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * drop all entries, which may race with the readers and writers as store does
+	 */
+	void clear() {
+		for (entry& e : table) {
+			__atomic_store_n(&e.check, uint64_t(0), __ATOMIC_RELAXED);
+			__atomic_store_n(&e.data, uint64_t(0), __ATOMIC_RELAXED);
+		}
+	}
+
+private:
+	struct entry {
+		uint64_t check;
+		uint64_t data;
+		entry() : check(0), data(0) {}
+	};
+	std::vector<entry> table;
+	uint64_t mask;
+};
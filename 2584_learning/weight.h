@@ -11,39 +11,85 @@
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <cstdint>
 
-class weight {
+/**
+ * a table either owns its entries, or views entries stored elsewhere (e.g., in a mapped weight file);
+ * copying a table always yields a table that owns a copy of the entries
+ *
+ * the entries are float for training, see qweight for the quantized tables used in evaluation
+ */
+template<typename entry>
+class basic_weight {
 public:
-	typedef float type;
+	typedef entry type;
 
 public:
-	weight() {}
-	weight(size_t len) : value(len) {}
-	weight(weight&& f) : value(std::move(f.value)) {}
-	weight(const weight& f) = default;
+	basic_weight() : table(nullptr), length(0) {}
+	basic_weight(size_t len) : value(len), table(value.data()), length(len) {}
+	basic_weight(type* view, size_t len) : table(view), length(len) {}
+	basic_weight(basic_weight&& f) noexcept : value(std::move(f.value)), table(f.table), length(f.length) {}
+	basic_weight(const basic_weight& f) : value(f.table, f.table + f.length), table(value.data()), length(f.length) {}
 
-	weight& operator =(const weight& f) = default;
-	type& operator[] (size_t i) { return value[i]; }
-	const type& operator[] (size_t i) const { return value[i]; }
-	size_t size() const { return value.size(); }
+	basic_weight& operator =(const basic_weight& f) {
+		if (this != &f) {
+			value.assign(f.table, f.table + f.length);
+			table = value.data();
+			length = f.length;
+		}
+		return *this;
+	}
+	basic_weight& operator =(basic_weight&& f) noexcept {
+		value = std::move(f.value);
+		table = f.table;
+		length = f.length;
+		return *this;
+	}
+	type& operator[] (size_t i) { return table[i]; }
+	const type& operator[] (size_t i) const { return table[i]; }
+	size_t size() const { return length; }
+	type* data() { return table; }
+	const type* data() const { return table; }
+
+	/**
+	 * add v to the i-th entry with relaxed atomic load and store (Hogwild!-style)
+	 * so that several threads may train the same table without locking;
+	 * concurrent updates of the same entry may overwrite each other
+	 */
+	void add(size_t i, type v) { add(table[i], v); }
+	static void add(type& w, type v) {
+		type t;
+		__atomic_load(&w, &t, __ATOMIC_RELAXED);
+		t += v;
+		__atomic_store(&w, &t, __ATOMIC_RELAXED);
+	}
 
 public:
-	friend std::ostream& operator <<(std::ostream& out, const weight& w) {
-		auto& value = w.value;
-		uint64_t size = value.size();
+	friend std::ostream& operator <<(std::ostream& out, const basic_weight& w) {
+		uint64_t size = w.length;
 		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-		out.write(reinterpret_cast<const char*>(value.data()), sizeof(type) * size);
+		out.write(reinterpret_cast<const char*>(w.table), sizeof(type) * size);
 		return out;
 	}
-	friend std::istream& operator >>(std::istream& in, weight& w) {
-		auto& value = w.value;
+	friend std::istream& operator >>(std::istream& in, basic_weight& w) {
 		uint64_t size = 0;
 		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-		value.resize(size);
-		in.read(reinterpret_cast<char*>(value.data()), sizeof(type) * size);
+		w.value.resize(size);
+		w.table = w.value.data();
+		w.length = size;
+		in.read(reinterpret_cast<char*>(w.table), sizeof(type) * size);
 		return in;
 	}
 
 protected:
 	std::vector<type> value;
+	type* table;
+	size_t length;
 };
+
+typedef basic_weight<float> weight;
+
+/**
+ * int16 entries, each representing (entry * scale) with a scale per table
+ */
+typedef basic_weight<int16_t> qweight;